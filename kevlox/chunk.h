@@ -30,6 +30,8 @@ typedef enum {
     OP_JUMP,           // 3 bytes: [opcode, jump offset]      - unconditionally jumps to a new instruction offset
     OP_JUMP_IF_FALSE,  // 3 bytes: [opcode, jump offset]      - jumps to a new instruction offset if the top stack value is false
     OP_LOOP,           // 3 bytes: [opcode, loop offset]      - jumps backward by a specified offset (used for loops)
+    OP_LOOP_LESS_LOCAL,    // 5 bytes: [opcode, counter slot, limit slot, loop offset]     - adds 1 to a local and jumps back while it's less than the limit local
+    OP_LOOP_LESS_CONSTANT, // 5 bytes: [opcode, counter slot, limit constant, loop offset] - adds 1 to a local and jumps back while it's less than the limit constant
     OP_CALL,           // 2 bytes: [opcode, argument count]   - calls a function with the specified number of arguments
     OP_CLOSURE,        // Variable bytes: [opcode, function index, upvalue count, upvalue indices] - creates a closure for a function
     OP_CLOSE_UPVALUE,
@@ -9,7 +9,11 @@
 // #define DEBUG_PRINT_CODE
 
 // #define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
+// #define DEBUG_LOG_GC
+
+// 64-bit hosts only: objects go in one 4GB reservation and values become 8 byte NaN-boxed
+// doubles that refer to objects by 32-bit offset
+// #define POINTER_COMPRESSION
 
 #define UINT8_COUNT (UINT8_MAX+1)
 
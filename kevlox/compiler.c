@@ -5,6 +5,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "number.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -68,13 +69,95 @@ typedef struct Compiler {
     int localCount;                // number of locals in use
     Upvalue upvalues[UINT8_COUNT]; // upvalues captured by the function (for closures)
     int scopeDepth;                // current nesting level of scopes
+    int stackDepth;                // stack slots in use at the current point in the bytecode
+    int level;                     // how deeply this function is nested, 0 for the script
+    Chunk* chunk;                  // scratch chunk the bytecode is written into until endCompiler()
 } Compiler;
 
 Parser parser;
 Compiler* current = NULL; // global compiler object
 
+// one scratch chunk per function nesting level, kept across functions and compiles so that once
+// they've grown, emitting bytecode doesn't allocate at all. they're plain malloc memory,
+// so writing to them never goes through reallocate() and can't start a garbage collection.
+// when one can't grow it's left as it was, ready for the next compile
+static Chunk** scratchChunks = NULL;
+static int scratchCount = 0;
+
 static Chunk* currentChunk() {
-    return &current->function->chunk;
+    return current->chunk;
+}
+
+static Chunk* scratchChunk(int level) {
+    if (level >= scratchCount) {
+        Chunk** chunks = (Chunk**)realloc(scratchChunks, sizeof(Chunk*) * (level + 1));
+        if (chunks == NULL) outOfMemory(sizeof(Chunk*) * (level + 1));
+        scratchChunks = chunks;
+
+        for (; scratchCount <= level; scratchCount++) {
+            Chunk* chunk = (Chunk*)malloc(sizeof(Chunk));
+            if (chunk == NULL) outOfMemory(sizeof(Chunk));
+            initChunk(chunk);
+            scratchChunks[scratchCount] = chunk;
+        }
+    }
+
+    Chunk* chunk = scratchChunks[level];
+    chunk->count = 0;
+    chunk->constants.count = 0;
+    return chunk;
+}
+
+static void writeScratch(Chunk* chunk, uint8_t byte, int line) {
+    if (chunk->capacity < chunk->count + 1) {
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        uint8_t* code = (uint8_t*)realloc(chunk->code, sizeof(uint8_t) * capacity);
+        if (code == NULL) outOfMemory(sizeof(uint8_t) * capacity);
+        chunk->code = code;
+        int* lines = (int*)realloc(chunk->lines, sizeof(int) * capacity);
+        if (lines == NULL) outOfMemory(sizeof(int) * capacity);
+        chunk->lines = lines;
+        chunk->capacity = capacity;
+    }
+
+    chunk->code[chunk->count] = byte;
+    chunk->lines[chunk->count] = line;
+    chunk->count++;
+}
+
+static int addScratchConstant(Chunk* chunk, Value value) {
+    ValueArray* constants = &chunk->constants;
+    if (constants->capacity < constants->count + 1) {
+        int capacity = GROW_CAPACITY(constants->capacity);
+        Value* values = (Value*)realloc(constants->values, sizeof(Value) * capacity);
+        if (values == NULL) outOfMemory(sizeof(Value) * capacity);
+        constants->values = values;
+        constants->capacity = capacity;
+    }
+
+    constants->values[constants->count] = value;
+    return constants->count++;
+}
+
+// copies the finished scratch chunk into the function with exactly sized arrays
+static void finishChunk(ObjFunction* function, Chunk* scratch) {
+    // these can collect, the scratch constants are still marked by markCompilerRoots() until we're done
+    uint8_t* code = ALLOCATE(uint8_t, scratch->count);
+    int* lines = ALLOCATE(int, scratch->count);
+    Value* constants = ALLOCATE(Value, scratch->constants.count);
+
+    memcpy(code, scratch->code, sizeof(uint8_t) * scratch->count);
+    memcpy(lines, scratch->lines, sizeof(int) * scratch->count);
+    if (scratch->constants.count > 0) {
+        memcpy(constants, scratch->constants.values, sizeof(Value) * scratch->constants.count);
+    }
+
+    Chunk* chunk = &function->chunk;
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = chunk->capacity = scratch->count;
+    chunk->constants.values = constants;
+    chunk->constants.count = chunk->constants.capacity = scratch->constants.count;
 }
 
 // print where the error occured
@@ -138,17 +221,63 @@ static bool match(TokenType type) {
 // writes the given byte to the chunk, which may be an opcode or an operand to an instruction
 // also sends in the previous token’s line information so that runtime errors are associated with that line
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeScratch(currentChunk(), byte, parser.previous.line);
+}
+
+// tracks how deep the stack gets so the VM can check for room once per call instead of on every push
+static void adjustStack(int effect) {
+    current->stackDepth += effect;
+    if (current->stackDepth > current->function->maxStack) {
+        current->function->maxStack = current->stackDepth;
+    }
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+// net number of values an instruction leaves on the stack
+// OP_CALL's effect depends on its argument count so call() accounts for it
+static int stackEffect(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+// writes an opcode and accounts for its effect on the stack
+static void emitOp(uint8_t instruction) {
+    emitByte(instruction);
+    adjustStack(stackEffect(instruction));
+}
+
+// writes an opcode followed by its one byte operand
+static void emitBytes(uint8_t instruction, uint8_t operand) {
+    emitOp(instruction);
+    emitByte(operand);
 }
 
 // writes loop to byte chunk
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    emitOp(OP_LOOP);
 
     int offset = currentChunk()->count - loopStart + 2;
     if (offset > UINT16_MAX) error("Loop body too large.");
@@ -158,19 +287,19 @@ static void emitLoop(int loopStart) {
 }
 
 static int emitJump(uint8_t instruction) {
-    emitByte(instruction); // writes the opcode for the jump instruction to the current chunk of bytecode
+    emitOp(instruction); // writes the opcode for the jump instruction to the current chunk of bytecode
     emitByte(0xff); // placeholder
     emitByte(0xff); // placeholder
     return currentChunk()->count - 2; // returns the index of the first placeholder byte
 }
 
 static void emitReturn() {
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitOp(OP_NIL);
+    emitOp(OP_RETURN);
 }
 
 static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
+    int constant = addScratchConstant(currentChunk(), value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk");
         return 0;
@@ -206,13 +335,17 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->stackDepth = 0;
+    compiler->level = current == NULL ? 0 : current->level + 1;
+    compiler->chunk = scratchChunk(compiler->level);
     compiler->function = newFunction();
 
     current = compiler;
+    adjustStack(1); // slot 0 holds the function being called
 
     // set function name, we've already parsed it
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        current->function->name = internString(parser.previous.start, parser.previous.length);
     }
 
     // initialize the first local variable slot
@@ -226,9 +359,10 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    finishChunk(function, currentChunk());
 
     #ifdef DEBUG_PRINT_CODE
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassembleChunk(&function->chunk, function->name != NULL ? function->name->chars : "<script>");
     #endif
 
     current = current->enclosing;
@@ -244,16 +378,16 @@ static void beginScope() {
 
 // subtracts scope depth and removes locals from previous scope
 static void endScope() {
+    current->scopeDepth--;
+
     while(current->localCount > 0 && current->locals[current->localCount -1].depth > current->scopeDepth) {
         if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitOp(OP_CLOSE_UPVALUE);
         } else {
-        emitByte(OP_POP);
+        emitOp(OP_POP);
         }
         current->localCount--;
     }
-
-    current->scopeDepth--;
 }
 
 // =============== forward declarations ===============
@@ -282,16 +416,16 @@ static void binary(bool canAssign) {
 
     // emit bytecode of the operator instruction
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:  emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:  emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL: emitOp(OP_EQUAL); emitOp(OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL: emitOp(OP_EQUAL); break;
+        case TOKEN_GREATER: emitOp(OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitOp(OP_LESS); emitOp(OP_NOT); break;
+        case TOKEN_LESS: emitOp(OP_LESS); break;
+        case TOKEN_LESS_EQUAL: emitOp(OP_GREATER); emitOp(OP_NOT); break;
+        case TOKEN_PLUS:  emitOp(OP_ADD); break;
+        case TOKEN_MINUS: emitOp(OP_SUBTRACT); break;
+        case TOKEN_STAR:  emitOp(OP_MULTIPLY); break;
+        case TOKEN_SLASH: emitOp(OP_DIVIDE); break;
         default:
             return;
     }
@@ -300,13 +434,14 @@ static void binary(bool canAssign) {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    adjustStack(-argCount); // the arguments and callee are replaced by the result
 }
 
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitOp(OP_FALSE); break;
+        case TOKEN_NIL: emitOp(OP_NIL); break;
+        case TOKEN_TRUE: emitOp(OP_TRUE); break;
         default:
             return; // unreachable
     }
@@ -318,8 +453,11 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value;
+    parseNumber(parser.previous.start, parser.previous.start + parser.previous.length, &value);
+
+    // integral literals that fit take the integer fast path at runtime
+    emitConstant(numberValue(value));
 }
 
 static void or_(bool canAssign) {
@@ -330,7 +468,7 @@ static void or_(bool canAssign) {
   int endJump = emitJump(OP_JUMP);
 
   backpatchJump(elseJump);      // Patch to continue parsing the second operand
-  emitByte(OP_POP);         // Pop the first operand
+  emitOp(OP_POP);         // Pop the first operand
 
   parsePrecedence(PREC_OR); // Parse the second operand
   backpatchJump(endJump);       // Patch to skip the second operand if already evaluated
@@ -341,7 +479,7 @@ static void string(bool canAssign) {
     // + trim lead  quotation mark
     // - trim trailing quotation mark
     // create a string object, wrap it ina value, stuffs it into the constant table
-    emitConstant(OBJ_VAL(copyString(parser.previous.start+1, parser.previous.length-2)));
+    emitConstant(OBJ_VAL(internString(parser.previous.start+1, parser.previous.length-2)));
 }
 
 static void namedVariable(Token name, bool canAssign) {
@@ -380,8 +518,8 @@ static void unary(bool canAssign) {
 
     // emit the operator instruction
     switch(operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitOp(OP_NOT); break;
+        case TOKEN_MINUS: emitOp(OP_NEGATE); break;
         default:
             return; // unreachable
     }
@@ -458,7 +596,7 @@ static void parsePrecedence(Precedence precedence) {
 
 // takes the given token and adds its lexeme to the chunk’s constant table as a string and then returns the index of that constant in the constant table
 static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL(internString(name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -600,7 +738,7 @@ static uint8_t argumentList() {
 static void and_(bool canAssign) {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     parsePrecedence(PREC_AND);
 
     backpatchJump(endJump);
@@ -620,7 +758,56 @@ static void expression() {
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after value.");
-    emitByte(OP_POP); // we added into the hashmap so we can clear from the stack 
+    emitOp(OP_POP); // we added into the hashmap so we can clear from the stack 
+}
+
+// checks if the bytes from start to the end of the chunk are `counter < limit` with counter a local
+// and limit a local or constant, which is the condition OP_LOOP_LESS_* can test
+static bool matchLoopCondition(int start, uint8_t* counter, uint8_t* limitOp, uint8_t* limit) {
+    Chunk* chunk = currentChunk();
+    if (chunk->count - start != 5) return false;
+
+    uint8_t* code = &chunk->code[start];
+    if (code[0] != OP_GET_LOCAL || code[4] != OP_LESS) return false;
+
+    if (code[2] == OP_GET_LOCAL) {
+        *limitOp = OP_LOOP_LESS_LOCAL;
+    } else if (code[2] == OP_CONSTANT) {
+        *limitOp = OP_LOOP_LESS_CONSTANT;
+    } else {
+        return false;
+    }
+
+    *counter = code[1];
+    *limit = code[3];
+    return true;
+}
+
+// checks if the bytes from start to the end of the chunk are `counter = counter + 1`
+static bool matchLoopIncrement(int start, uint8_t counter) {
+    Chunk* chunk = currentChunk();
+    if (chunk->count - start != 7) return false;
+
+    uint8_t* code = &chunk->code[start];
+    if (code[0] != OP_GET_LOCAL || code[1] != counter) return false;
+    if (code[2] != OP_CONSTANT || code[4] != OP_ADD) return false;
+    if (code[5] != OP_SET_LOCAL || code[6] != counter) return false;
+
+    Value step = chunk->constants.values[code[3]];
+    return IS_NUMBER(step) && AS_NUMBER(step) == 1;
+}
+
+// writes a fused increment-compare-loop instruction that jumps back to loopStart
+static void emitLoopLess(uint8_t limitOp, uint8_t counter, uint8_t limit, int loopStart) {
+    emitOp(limitOp);
+    emitByte(counter);
+    emitByte(limit);
+
+    int offset = currentChunk()->count - loopStart + 2;
+    if (offset > UINT16_MAX) error("Loop body too large.");
+
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
 }
 
 static void forStatement() {
@@ -646,14 +833,17 @@ static void forStatement() {
 
   // Handle exit condition of the for loop
   int exitJump = -1;
+  bool countingLoop = false;
+  uint8_t counter = 0, limitOp = 0, limit = 0;
   if (!match(TOKEN_SEMICOLON)) {
     // Parse the exit condition expression
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' in for loop condition.");
+    countingLoop = matchLoopCondition(loopStart, &counter, &limitOp, &limit);
 
     // Emit a jump instruction to exit the loop if the condition is false
     exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Pop the condition value from the stack
+    emitOp(OP_POP); // Pop the condition value from the stack
   }
 
   // Handle increment part of the for loop
@@ -664,7 +854,30 @@ static void forStatement() {
     // Mark start of the increment expression
     int incrementStart = currentChunk()->count;
     expression();
-    emitByte(OP_POP); // Pop the increment value from the stack
+
+    if (countingLoop && matchLoopIncrement(incrementStart, counter)) {
+      // `for (...; i < n; i = i + 1)`: drop the body jump and the increment we just compiled,
+      // the body falls straight through to a single OP_LOOP_LESS_* that increments, tests and loops
+      currentChunk()->count = bodyJump - 1;
+      adjustStack(-1); // the increment's value went with it
+      consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'for' clause.");
+
+      int bodyStart = currentChunk()->count;
+      statement();
+      emitLoopLess(limitOp, counter, limit, bodyStart);
+
+      // falling out of the loop skips the pop of the condition value that only the exit jump leaves behind
+      int endJump = emitJump(OP_JUMP);
+      backpatchJump(exitJump);
+      adjustStack(1); // the exit jump arrives with the condition still on the stack
+      emitOp(OP_POP);
+      backpatchJump(endJump);
+
+      endScope();
+      return;
+    }
+
+    emitOp(OP_POP); // Pop the increment value from the stack
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after 'for' clause.");
 
     // Emit a loop instruction to jump back to the start of the loop
@@ -682,7 +895,8 @@ static void forStatement() {
   // Patch the exit jump if an exit condition was present
   if (exitJump != -1) {
     backpatchJump(exitJump);
-    emitByte(OP_POP); // Pop the condition value from the stack
+    adjustStack(1); // the exit jump arrives with the condition still on the stack
+    emitOp(OP_POP); // Pop the condition value from the stack
   }
 
   // End the scope of the for loop
@@ -698,13 +912,14 @@ static void ifStatement() {
 
     // how much to offset the instruction pointer in bytes of code to skip if false
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     statement();
 
     // else
     int elseJump = emitJump(OP_JUMP);
     backpatchJump(thenJump);
-    emitByte(OP_POP);
+    adjustStack(1); // the else branch starts with the condition still on the stack
+    emitOp(OP_POP);
 
     if (match(TOKEN_ELSE)) statement();
     backpatchJump(elseJump); // ensures the jump from the then block skips over the else block
@@ -732,6 +947,7 @@ static void function(FunctionType type) {
         if (current->function->arity > 255) {
             errorAtCurrent("Can't have more than 255 parameters.");
         }
+        adjustStack(1); // arguments are already on the stack when the body starts
         uint8_t constant = parseVariable("Expected parameter name.");
         defineVariable(constant);
         } while (match(TOKEN_COMMA));
@@ -765,7 +981,7 @@ static void varDeclaration() {
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emitByte(OP_NIL);
+        emitOp(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
 
@@ -775,7 +991,7 @@ static void varDeclaration() {
 static void printStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after value.");
-    emitByte(OP_PRINT);
+    emitOp(OP_PRINT);
 }
 
 static void returnStatement() {
@@ -788,7 +1004,7 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
-        emitByte(OP_RETURN);
+        emitOp(OP_RETURN);
     }
 }
 
@@ -799,12 +1015,13 @@ static void whileStatement() {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    emitOp(OP_POP);
     statement();
     emitLoop(loopStart);
 
     backpatchJump(exitJump);
-    emitByte(OP_POP);
+    adjustStack(1); // the exit jump arrives with the condition still on the stack
+    emitOp(OP_POP);
 }
 
 // recover from this panicMode and continue parsing at a logical point in the source code, rather than halting entirely or producing a cascade of errors
@@ -893,6 +1110,29 @@ void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
+
+        // constants only live in the scratch chunk until endCompiler() hands them to the function
+        for (int i = 0; i < compiler->chunk->constants.count; i++) {
+            markValue(compiler->chunk->constants.values[i]);
+        }
         compiler = compiler->enclosing;
     }
 }
+
+// forgets a compile that was abandoned partway, its compilers were on a stack that's gone
+void resetCompiler() {
+    current = NULL;
+}
+
+void freeCompilerScratch() {
+    for (int i = 0; i < scratchCount; i++) {
+        Chunk* chunk = scratchChunks[i];
+        free(chunk->code);
+        free(chunk->lines);
+        free(chunk->constants.values);
+        free(chunk);
+    }
+    free(scratchChunks);
+    scratchChunks = NULL;
+    scratchCount = 0;
+}
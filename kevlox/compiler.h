@@ -6,5 +6,7 @@
 
 ObjFunction* compile(const char* source);
 void markCompilerRoots();
+void freeCompilerScratch();
+void resetCompiler();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csv.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "vm.h"
+
+// csvNext() parses rows straight out of a fixed size read buffer, the fields of the current row are
+// offsets into that buffer, so reading a file of any size takes memory for the longest row only
+// and a field costs nothing until csvField() or csvNumber() asks for it
+
+#define CSV_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+    ROW_COMPLETE,
+    ROW_INCOMPLETE, // ran out of buffered data before the end of the row
+    ROW_MALFORMED,
+} RowResult;
+
+static void addField(ObjCsvReader* reader, int start, int length, bool escaped) {
+    if (reader->fieldCapacity < reader->fieldCount + 1) {
+        int oldCapacity = reader->fieldCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        reader->fields = GROW_ARRAY(CsvField, reader->fields, oldCapacity, capacity);
+        reader->fieldCapacity = capacity;
+    }
+
+    CsvField* field = &reader->fields[reader->fieldCount++];
+    field->start = start;
+    field->length = length;
+    field->escaped = escaped;
+}
+
+// parses the row at reader->position, atEnd means no more data will be read after what's buffered
+// nothing in the buffer is modified here so an incomplete row can be parsed again after a refill
+static RowResult parseRow(ObjCsvReader* reader, bool atEnd) {
+    const char* buffer = reader->buffer;
+    int length = reader->length;
+    int current = reader->position;
+    reader->fieldCount = 0;
+
+    for (;;) {
+        if (current < length && buffer[current] == '"') {
+            // quoted field, may hold commas, newlines and "" for a quote
+            int start = ++current;
+            bool escaped = false;
+            for (;;) {
+                if (current == length) return atEnd ? ROW_MALFORMED : ROW_INCOMPLETE;
+                if (buffer[current] == '"') {
+                    if (current + 1 == length && !atEnd) return ROW_INCOMPLETE;
+                    if (current + 1 < length && buffer[current + 1] == '"') {
+                        escaped = true;
+                        current += 2;
+                        continue;
+                    }
+                    break;
+                }
+                current++;
+            }
+            addField(reader, start, current - start, escaped);
+            current++; // closing quote
+        } else {
+            int start = current;
+            while (current < length) {
+                char c = buffer[current];
+                if (c == ',' || c == '\n' || c == '\r') break;
+                current++;
+            }
+            addField(reader, start, current - start, false);
+        }
+
+        if (current == length) {
+            if (!atEnd) return ROW_INCOMPLETE;
+            reader->position = current;
+            return ROW_COMPLETE;
+        }
+
+        switch (buffer[current]) {
+            case ',':
+                current++;
+                break;
+            case '\r':
+                if (current + 1 == length && !atEnd) return ROW_INCOMPLETE;
+                current++;
+                if (current < length && buffer[current] == '\n') current++;
+                reader->position = current;
+                return ROW_COMPLETE;
+            case '\n':
+                reader->position = current + 1;
+                return ROW_COMPLETE;
+            default:
+                // text after a quoted field's closing quote
+                return ROW_MALFORMED;
+        }
+    }
+}
+
+// collapses "" to " in place in each quoted field of the current row that has them
+static void unescapeFields(ObjCsvReader* reader) {
+    for (int i = 0; i < reader->fieldCount; i++) {
+        CsvField* field = &reader->fields[i];
+        if (!field->escaped) continue;
+
+        char* chars = reader->buffer + field->start;
+        int length = 0;
+        for (int j = 0; j < field->length; j++) {
+            chars[length++] = chars[j];
+            if (chars[j] == '"') j++;
+        }
+        field->length = length;
+        field->escaped = false;
+    }
+}
+
+// moves the unread part of the buffer to the front and reads more of the file after it,
+// the buffer only grows when a single row doesn't fit
+static void refill(ObjCsvReader* reader) {
+    int unread = reader->length - reader->position;
+    if (unread > 0) memmove(reader->buffer, reader->buffer + reader->position, unread);
+    reader->length = unread;
+    reader->position = 0;
+
+    if (reader->length == reader->capacity) {
+        int oldCapacity = reader->capacity;
+        int capacity = oldCapacity < CSV_BUFFER_SIZE ? CSV_BUFFER_SIZE : oldCapacity * 2;
+        reader->buffer = GROW_ARRAY(char, reader->buffer, oldCapacity, capacity);
+        reader->capacity = capacity;
+    }
+
+    size_t read = fread(reader->buffer + reader->length, 1, reader->capacity - reader->length, reader->file);
+    reader->length += (int)read;
+    if (read == 0) {
+        fclose(reader->file);
+        reader->file = NULL;
+    }
+}
+
+// reads the next row into the reader, returns false at the end of the file
+static bool readRow(ObjCsvReader* reader, bool* malformed) {
+    *malformed = false;
+    for (;;) {
+        bool atEnd = reader->file == NULL;
+        if (atEnd && reader->position == reader->length) {
+            reader->fieldCount = 0;
+            return false;
+        }
+
+        if (reader->position < reader->length) {
+            RowResult result = parseRow(reader, atEnd);
+            if (result == ROW_COMPLETE) {
+                unescapeFields(reader);
+                reader->row++;
+                return true;
+            }
+            if (result == ROW_MALFORMED) {
+                *malformed = true;
+                return false;
+            }
+        }
+
+        refill(reader);
+    }
+}
+
+static bool checkReader(Value value, const char* name) {
+    if (!IS_CSV_READER(value)) {
+        runtimeError("First argument to %s() must be a csv reader.", name);
+        return false;
+    }
+    return true;
+}
+
+// any whole number in range, whether it's stored as an int or a double
+static bool fieldIndex(ObjCsvReader* reader, Value value, CsvField** result) {
+    double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+    // written so NaN fails too, and only numbers that fit in an int get cast
+    if (!(number >= 0 && number < reader->fieldCount) || number != (int)number) {
+        runtimeError("Field index out of bounds, the current row has %d fields.", reader->fieldCount);
+        return false;
+    }
+
+    *result = &reader->fields[(int)number];
+    return true;
+}
+
+// csvOpen(path) returns a reader positioned before the first row
+static bool csvOpenNative(int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        runtimeError("Argument to csvOpen() must be a path string.");
+        return false;
+    }
+
+    // the reader comes first so the file is never left open with nothing to close it if allocating
+    // the reader fails
+    ObjCsvReader* reader = newCsvReader(NULL);
+    args[-1] = OBJ_VAL(reader);
+    reader->file = fopen(AS_CSTRING(args[0]), "rb");
+    if (reader->file == NULL) {
+        runtimeError("Could not open file \"%s\".", AS_CSTRING(args[0]));
+        return false;
+    }
+    return true;
+}
+
+// csvNext(reader) moves to the next row and returns the reader, which is also the row, or nil at the end
+static bool csvNextNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvNext")) return false;
+    ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+    bool malformed;
+    if (readRow(reader, &malformed)) {
+        args[-1] = args[0];
+    } else if (malformed) {
+        runtimeError("Malformed quoted field in CSV row %d.", reader->row + 1);
+        return false;
+    } else {
+        args[-1] = NIL_VAL;
+    }
+    return true;
+}
+
+// csvCount(row) is the number of fields in the current row
+static bool csvCountNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvCount")) return false;
+    args[-1] = INT_VAL(AS_CSV_READER(args[0])->fieldCount);
+    return true;
+}
+
+// csvField(row, index) returns a field of the current row as a string
+static bool csvFieldNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvField")) return false;
+    ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+    CsvField* field;
+    if (!fieldIndex(reader, args[1], &field)) return false;
+    args[-1] = OBJ_VAL(copyString(reader->buffer + field->start, field->length));
+    return true;
+}
+
+// csvNumber(row, index) reads a field of the current row as a number without making a string,
+// an empty or non-numeric field gives nil
+static bool csvNumberNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvNumber")) return false;
+    ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+    CsvField* field;
+    if (!fieldIndex(reader, args[1], &field)) return false;
+
+    // the whole field has to be the number
+    const char* start = reader->buffer + field->start;
+    double value;
+    if (field->length > 0 && parseNumber(start, start + field->length, &value) == field->length) {
+        args[-1] = numberValue(value);
+    } else {
+        args[-1] = NIL_VAL;
+    }
+    return true;
+}
+
+// csvFieldIs(row, index, string) compares a field of the current row without making a string
+static bool csvFieldIsNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvFieldIs")) return false;
+    ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+    CsvField* field;
+    if (!fieldIndex(reader, args[1], &field)) return false;
+    if (!IS_STRING(args[2])) {
+        runtimeError("Third argument to csvFieldIs() must be a string.");
+        return false;
+    }
+
+    ObjString* string = AS_STRING(args[2]);
+    args[-1] = BOOL_VAL(string->length == field->length &&
+                        memcmp(string->chars, reader->buffer + field->start, field->length) == 0);
+    return true;
+}
+
+// csvClose(reader) closes the file early, the garbage collector closes it otherwise
+static bool csvCloseNative(int argCount, Value* args) {
+    if (!checkReader(args[0], "csvClose")) return false;
+    ObjCsvReader* reader = AS_CSV_READER(args[0]);
+
+    if (reader->file != NULL) {
+        fclose(reader->file);
+        reader->file = NULL;
+    }
+    reader->position = reader->length;
+    reader->fieldCount = 0;
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+void defineCsvNatives() {
+    defineNative("csvOpen", csvOpenNative, 1);
+    defineNative("csvNext", csvNextNative, 1);
+    defineNative("csvCount", csvCountNative, 1);
+    defineNative("csvField", csvFieldNative, 2);
+    defineNative("csvNumber", csvNumberNative, 2);
+    defineNative("csvFieldIs", csvFieldIsNative, 3);
+    defineNative("csvClose", csvCloseNative, 1);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_csv_h
+#define clox_csv_h
+
+void defineCsvNatives();
+
+#endif
@@ -21,7 +21,7 @@ static int simpleInstruction(const char* name, int offset) {
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t slot = chunk->code[offset+1];
     printf("%-16s %4d\n", name, slot);
-    return offset + 1;
+    return offset + 2; // opcode and operand
 }
 
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
@@ -31,6 +31,15 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+static int loopLessInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t counter = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d < %d -> %d\n", name, counter, limit, offset + 5 - jump);
+    return offset + 5;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset+1];
     printf("%-16s %4d '", name, constant);
@@ -75,6 +84,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_JUMP:               return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:      return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:               return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LESS_LOCAL:    return loopLessInstruction("OP_LOOP_LESS_LOCAL", chunk, offset);
+        case OP_LOOP_LESS_CONSTANT: return loopLessInstruction("OP_LOOP_LESS_CONSTANT", chunk, offset);
         case OP_CALL:               return byteInstruction("OP_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
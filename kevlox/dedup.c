@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "memory.h"
+#include "vm.h"
+
+// strings that aren't interned can have equal contents. the sweeper hands each one that's lived
+// through two collections to dedupString(), which makes it share chars with any earlier string
+// with the same contents. shared chars are counted here and freed with the last string using them.
+// the table is the collector's own memory, like the gray stack, so growing it can't start a collection.
+// natives hold pointers into strings' chars across allocations, so a collection that runs inside one
+// only lists the strings it would deduplicate, and they're deduplicated once no native is running.
+// every collection makes the list again, so the strings on it are always live
+
+#define DEDUP_MAX_LOAD 0.75
+
+typedef struct {
+    char* chars; // NULL for an empty entry or, with refs of 1, a tombstone
+    int length;
+    uint32_t hash;
+    uint32_t refs; // strings whose chars these are
+} SharedChars;
+
+static SharedChars* entries = NULL;
+static int count = 0; // including tombstones
+static int live = 0; // entries with chars
+static int capacity = 0;
+
+static ObjString** deferred = NULL;
+static int deferredCount = 0;
+static int deferredCapacity = 0;
+
+// the entry with these contents, or where they would go
+static SharedChars* findContents(SharedChars* table, int tableCapacity, const char* chars, int length, uint32_t hash) {
+    uint32_t index = hash % tableCapacity;
+    SharedChars* tombstone = NULL;
+
+    for (;;) {
+        SharedChars* entry = &table[index];
+        if (entry->chars == NULL) {
+            if (entry->refs == 0) return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->hash == hash && entry->length == length && memcmp(entry->chars, chars, length) == 0) {
+            return entry;
+        }
+        index = (index + 1) % tableCapacity;
+    }
+}
+
+// rebuilds the table sized from the live entries alone, so tombstones are dropped and a table that
+// has mostly emptied shrinks. the live entries fill at most half of the load it allows. returns
+// false, leaving the table as it was, if there's no memory for the new one
+static bool rebuild() {
+    int newCapacity = 8;
+    while (newCapacity * DEDUP_MAX_LOAD < live * 2) newCapacity *= 2;
+
+    SharedChars* table = (SharedChars*)calloc(newCapacity, sizeof(SharedChars));
+    if (table == NULL) return false;
+
+    count = 0; // tombstones aren't carried over
+    for (int i = 0; i < capacity; i++) {
+        SharedChars* entry = &entries[i];
+        if (entry->chars == NULL) continue;
+        *findContents(table, newCapacity, entry->chars, entry->length, entry->hash) = *entry;
+        count++;
+    }
+
+    free(entries);
+    entries = table;
+    capacity = newCapacity;
+    return true;
+}
+
+// string mustn't be interned or shared already. this can run in the middle of sweeping, so running out
+// of memory just leaves the string with its own chars
+void dedupString(ObjString* string) {
+    if (vm.nativeDepth > 0) {
+        if (deferredCount + 1 > deferredCapacity) {
+            int grownCapacity = GROW_CAPACITY(deferredCapacity);
+            ObjString** grown = (ObjString**)realloc(deferred, sizeof(ObjString*) * grownCapacity);
+            if (grown == NULL) return;
+            deferred = grown;
+            deferredCapacity = grownCapacity;
+        }
+        deferred[deferredCount++] = string;
+        return;
+    }
+
+    if (count + 1 > capacity * DEDUP_MAX_LOAD && !rebuild()) return;
+
+    SharedChars* entry = findContents(entries, capacity, string->chars, string->length, string->hash);
+    if (entry->chars != NULL) {
+        FREE_ARRAY(char, string->chars, string->length + 1);
+        string->chars = entry->chars;
+        entry->refs++;
+    } else {
+        if (entry->refs == 0) count++; // not reusing a tombstone
+        live++;
+        entry->chars = string->chars;
+        entry->length = string->length;
+        entry->hash = string->hash;
+        entry->refs = 1;
+    }
+    string->obj.flags |= OBJ_FLAG_SHARED;
+}
+
+// for a shared string being freed, frees its chars if no other string is using them. new entries
+// reuse tombstones, so a table left mostly empty is shrunk here rather than when it fills
+void releaseSharedChars(ObjString* string) {
+    uint32_t index = string->hash % capacity;
+    while (entries[index].chars != string->chars) index = (index + 1) % capacity;
+
+    SharedChars* entry = &entries[index];
+    if (--entry->refs > 0) return;
+    FREE_ARRAY(char, entry->chars, entry->length + 1);
+    entry->chars = NULL;
+    entry->refs = 1; // tombstone
+    live--;
+    if (capacity > 8 && live < capacity * DEDUP_MAX_LOAD / 8) rebuild(); // or stays as big if it can't
+}
+
+// forgets the strings listed by the last collection, the next one lists the ones still alive
+void dropDeferredStrings() {
+    deferredCount = 0;
+}
+
+// deduplicates the strings listed while a native was running, now that none is
+void dedupDeferredStrings() {
+    for (int i = 0; i < deferredCount; i++) {
+        // a string interned since it was listed is the one with its contents now, it keeps its chars
+        ObjString* string = deferred[i];
+        if (!(string->obj.flags & OBJ_FLAG_INTERNED)) dedupString(string);
+    }
+    deferredCount = 0;
+}
+
+// every shared string has been freed by now
+void freeDedupTable() {
+    free(deferred);
+    deferred = NULL;
+    deferredCount = 0;
+    deferredCapacity = 0;
+    free(entries);
+    entries = NULL;
+    count = 0;
+    live = 0;
+    capacity = 0;
+}
@@ -0,0 +1,12 @@
+#ifndef clox_dedup_h
+#define clox_dedup_h
+
+#include "object.h"
+
+void dedupString(ObjString* string);
+void releaseSharedChars(ObjString* string);
+void dropDeferredStrings();
+void dedupDeferredStrings();
+void freeDedupTable();
+
+#endif
@@ -0,0 +1,618 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "json.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "vm.h"
+
+// jsonParse() builds arrays, maps and strings straight into the VM heap in one pass over the input,
+// jsonStringify() writes straight into the buffer that becomes the result string.
+// the hot loops (whitespace, string bodies) look at 16 bytes at a time when SSE2 is available
+
+#define JSON_MAX_DEPTH 512
+
+// =============== scanning ===============
+
+static inline bool isJsonSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static const char* skipWhitespace(const char* current, const char* end) {
+    // compact JSON has no whitespace at all so check one byte before going wide
+    if (current == end || !isJsonSpace(*current)) return current;
+
+    #ifdef __SSE2__
+    while (end - current >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)current);
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))));
+        int notSpace = ~_mm_movemask_epi8(space) & 0xffff;
+        if (notSpace != 0) return current + __builtin_ctz(notSpace);
+        current += 16;
+    }
+    #endif
+
+    while (current < end && isJsonSpace(*current)) current++;
+    return current;
+}
+
+// skips to the first byte in a string body that needs a closer look:
+// a quote, a backslash, a control character or the start of a non-ASCII sequence
+static const char* skipPlainChars(const char* current, const char* end) {
+    #ifdef __SSE2__
+    while (end - current >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)current);
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))),
+            // unsigned chunk <= 0x1f
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f)));
+        // the sign bit marks bytes >= 0x80
+        int mask = _mm_movemask_epi8(special) | _mm_movemask_epi8(chunk);
+        if (mask != 0) return current + __builtin_ctz(mask);
+        current += 16;
+    }
+    #endif
+
+    while (current < end) {
+        unsigned char c = (unsigned char)*current;
+        if (c == '"' || c == '\\' || c < 0x20 || c >= 0x80) break;
+        current++;
+    }
+    return current;
+}
+
+// returns the length of the well formed UTF-8 sequence at current, or 0 if it isn't one
+static int utf8SequenceLength(const unsigned char* current, const unsigned char* end) {
+    int length;
+    uint32_t codePoint;
+    if (current[0] >= 0xc2 && current[0] <= 0xdf) {
+        length = 2;
+        codePoint = current[0] & 0x1f;
+    } else if (current[0] >= 0xe0 && current[0] <= 0xef) {
+        length = 3;
+        codePoint = current[0] & 0x0f;
+    } else if (current[0] >= 0xf0 && current[0] <= 0xf4) {
+        length = 4;
+        codePoint = current[0] & 0x07;
+    } else {
+        return 0;
+    }
+
+    if (end - current < length) return 0;
+    for (int i = 1; i < length; i++) {
+        if ((current[i] & 0xc0) != 0x80) return 0;
+        codePoint = (codePoint << 6) | (current[i] & 0x3f);
+    }
+
+    // reject overlong encodings, surrogates and anything past U+10FFFF
+    if (length == 3 && (codePoint < 0x800 || (codePoint >= 0xd800 && codePoint <= 0xdfff))) return 0;
+    if (length == 4 && (codePoint < 0x10000 || codePoint > 0x10ffff)) return 0;
+    return length;
+}
+
+// =============== parser ===============
+
+typedef struct {
+    const char* start;
+    const char* current;
+    const char* end;
+    int depth;
+
+    // unescaped string contents, only used for strings that have escapes
+    ObjStringBuilder* buffer;
+} JsonParser;
+
+static bool jsonError(JsonParser* parser, const char* message) {
+    runtimeError("Invalid JSON at byte %d: %s", (int)(parser->current - parser->start), message);
+    return false;
+}
+
+static void bufferAppend(JsonParser* parser, const char* chars, int length) {
+    appendStringBuilder(parser->buffer, chars, length);
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool readHex4(JsonParser* parser, uint32_t* result) {
+    if (parser->end - parser->current < 4) return jsonError(parser, "Truncated \\u escape.");
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hexDigit(parser->current[i]);
+        if (digit < 0) return jsonError(parser, "Invalid \\u escape.");
+        value = (value << 4) | digit;
+    }
+    parser->current += 4;
+    *result = value;
+    return true;
+}
+
+static void appendCodePoint(JsonParser* parser, uint32_t codePoint) {
+    char bytes[4];
+    int length;
+    if (codePoint < 0x80) {
+        bytes[0] = (char)codePoint;
+        length = 1;
+    } else if (codePoint < 0x800) {
+        bytes[0] = (char)(0xc0 | (codePoint >> 6));
+        bytes[1] = (char)(0x80 | (codePoint & 0x3f));
+        length = 2;
+    } else if (codePoint < 0x10000) {
+        bytes[0] = (char)(0xe0 | (codePoint >> 12));
+        bytes[1] = (char)(0x80 | ((codePoint >> 6) & 0x3f));
+        bytes[2] = (char)(0x80 | (codePoint & 0x3f));
+        length = 3;
+    } else {
+        bytes[0] = (char)(0xf0 | (codePoint >> 18));
+        bytes[1] = (char)(0x80 | ((codePoint >> 12) & 0x3f));
+        bytes[2] = (char)(0x80 | ((codePoint >> 6) & 0x3f));
+        bytes[3] = (char)(0x80 | (codePoint & 0x3f));
+        length = 4;
+    }
+    bufferAppend(parser, bytes, length);
+}
+
+static bool parseEscape(JsonParser* parser) {
+    parser->current++; // backslash
+    if (parser->current == parser->end) return jsonError(parser, "Unterminated string.");
+
+    char c = *parser->current++;
+    switch (c) {
+        case '"':  bufferAppend(parser, "\"", 1); return true;
+        case '\\': bufferAppend(parser, "\\", 1); return true;
+        case '/':  bufferAppend(parser, "/", 1); return true;
+        case 'b':  bufferAppend(parser, "\b", 1); return true;
+        case 'f':  bufferAppend(parser, "\f", 1); return true;
+        case 'n':  bufferAppend(parser, "\n", 1); return true;
+        case 'r':  bufferAppend(parser, "\r", 1); return true;
+        case 't':  bufferAppend(parser, "\t", 1); return true;
+        case 'u': {
+            uint32_t codePoint;
+            if (!readHex4(parser, &codePoint)) return false;
+
+            if (codePoint >= 0xd800 && codePoint <= 0xdbff) {
+                // high surrogate, must be followed by an escaped low surrogate
+                uint32_t low;
+                if (parser->end - parser->current < 2 || parser->current[0] != '\\' || parser->current[1] != 'u') {
+                    return jsonError(parser, "Unpaired surrogate in \\u escape.");
+                }
+                parser->current += 2;
+                if (!readHex4(parser, &low)) return false;
+                if (low < 0xdc00 || low > 0xdfff) return jsonError(parser, "Unpaired surrogate in \\u escape.");
+                codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+            } else if (codePoint >= 0xdc00 && codePoint <= 0xdfff) {
+                return jsonError(parser, "Unpaired surrogate in \\u escape.");
+            }
+
+            appendCodePoint(parser, codePoint);
+            return true;
+        }
+        default:
+            parser->current--;
+            return jsonError(parser, "Invalid escape.");
+    }
+}
+
+// parses the string at the current quote and pushes it
+static bool parseString(JsonParser* parser) {
+    parser->current++; // opening quote
+    const char* start = parser->current;
+    bool escaped = false;
+    parser->buffer->length = 0;
+
+    for (;;) {
+        const char* run = parser->current;
+        parser->current = skipPlainChars(parser->current, parser->end);
+        if (escaped) bufferAppend(parser, run, (int)(parser->current - run));
+
+        if (parser->current == parser->end) return jsonError(parser, "Unterminated string.");
+
+        unsigned char c = (unsigned char)*parser->current;
+        if (c == '"') break;
+
+        if (c == '\\') {
+            if (!escaped) {
+                // first escape, everything so far is plain so copy it and switch to the buffer
+                escaped = true;
+                bufferAppend(parser, start, (int)(parser->current - start));
+            }
+            if (!parseEscape(parser)) return false;
+        } else if (c < 0x20) {
+            return jsonError(parser, "Control character in string.");
+        } else {
+            int length = utf8SequenceLength((const unsigned char*)parser->current, (const unsigned char*)parser->end);
+            if (length == 0) return jsonError(parser, "Invalid UTF-8 in string.");
+            if (escaped) bufferAppend(parser, parser->current, length);
+            parser->current += length;
+        }
+    }
+
+    ObjString* string = escaped ? copyString(parser->buffer->chars, parser->buffer->length)
+                                : copyString(start, (int)(parser->current - start));
+    parser->current++; // closing quote
+    push(OBJ_VAL(string));
+    return true;
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// validates the number against the JSON grammar and pushes it
+static bool parseJsonNumber(JsonParser* parser) {
+    const char* start = parser->current;
+    const char* current = start;
+    const char* end = parser->end;
+    bool integral = true;
+
+    if (current < end && *current == '-') current++;
+    if (current == end || !isDigit(*current)) return jsonError(parser, "Invalid number.");
+    if (*current == '0') {
+        current++;
+    } else {
+        while (current < end && isDigit(*current)) current++;
+    }
+
+    if (current < end && *current == '.') {
+        integral = false;
+        current++;
+        if (current == end || !isDigit(*current)) return jsonError(parser, "Invalid number.");
+        while (current < end && isDigit(*current)) current++;
+    }
+
+    if (current < end && (*current == 'e' || *current == 'E')) {
+        integral = false;
+        current++;
+        if (current < end && (*current == '+' || *current == '-')) current++;
+        if (current == end || !isDigit(*current)) return jsonError(parser, "Invalid number.");
+        while (current < end && isDigit(*current)) current++;
+    }
+
+    parser->current = current;
+
+    // short integers are most numbers in practice and don't need the general parser
+    int digits = (int)(current - start) - (*start == '-');
+    if (integral && digits <= 9) {
+        int32_t value = 0;
+        for (const char* c = start + (*start == '-'); c < current; c++) value = value * 10 + (*c - '0');
+        // -0 is a double
+        if (*start == '-') {
+            push(value == 0 ? NUMBER_VAL(-0.0) : INT_VAL(-value));
+        } else {
+            push(INT_VAL(value));
+        }
+        return true;
+    }
+
+    // the JSON grammar is a subset of what parseNumber() accepts, so it stops exactly where we did
+    double value;
+    parseNumber(start, current, &value);
+    push(NUMBER_VAL(value));
+    return true;
+}
+
+static bool parseLiteral(JsonParser* parser, const char* literal, int length, Value value) {
+    if (parser->end - parser->current < length || memcmp(parser->current, literal, length) != 0) {
+        return jsonError(parser, "Unexpected character.");
+    }
+    parser->current += length;
+    push(value);
+    return true;
+}
+
+static bool parseValue(JsonParser* parser);
+
+// containers are pushed as soon as they're created so the GC can see them while they fill up
+static bool enterContainer(JsonParser* parser) {
+    if (++parser->depth > JSON_MAX_DEPTH || vm.stackTop + 2 > vm.stack + STACK_MAX) {
+        return jsonError(parser, "Nested too deeply.");
+    }
+    parser->current++; // opening bracket
+    parser->current = skipWhitespace(parser->current, parser->end);
+    return true;
+}
+
+// after an element: returns true and sets done at the closing bracket, steps over a comma otherwise
+static bool nextElement(JsonParser* parser, char close, bool* done) {
+    parser->current = skipWhitespace(parser->current, parser->end);
+    if (parser->current == parser->end) return jsonError(parser, "Unexpected end of input.");
+
+    if (*parser->current == close) {
+        parser->current++;
+        parser->depth--;
+        *done = true;
+        return true;
+    }
+    if (*parser->current != ',') return jsonError(parser, "Expected ',' or closing bracket.");
+
+    parser->current++;
+    parser->current = skipWhitespace(parser->current, parser->end);
+    *done = false;
+    return true;
+}
+
+static bool parseArray(JsonParser* parser) {
+    if (!enterContainer(parser)) return false;
+
+    ObjArray* array = newArray();
+    push(OBJ_VAL(array));
+
+    if (parser->current < parser->end && *parser->current == ']') {
+        parser->current++;
+        parser->depth--;
+        return true;
+    }
+
+    bool done = false;
+    while (!done) {
+        if (!parseValue(parser)) return false;
+        writeValueArray(&array->items, vm.stackTop[-1]);
+        pop();
+        if (!nextElement(parser, ']', &done)) return false;
+    }
+    return true;
+}
+
+static bool parseObject(JsonParser* parser) {
+    if (!enterContainer(parser)) return false;
+
+    ObjMap* map = newMap();
+    push(OBJ_VAL(map));
+
+    if (parser->current < parser->end && *parser->current == '}') {
+        parser->current++;
+        parser->depth--;
+        return true;
+    }
+
+    bool done = false;
+    while (!done) {
+        if (parser->current == parser->end || *parser->current != '"') return jsonError(parser, "Expected string key.");
+        if (!parseString(parser)) return false;
+
+        parser->current = skipWhitespace(parser->current, parser->end);
+        if (parser->current == parser->end || *parser->current != ':') return jsonError(parser, "Expected ':' after key.");
+        parser->current++;
+
+        if (!parseValue(parser)) return false;
+        vm.stackTop[-2] = OBJ_VAL(intern(AS_STRING(vm.stackTop[-2]))); // the key stays on the stack while the table grows
+        tableSet(&map->table, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+        pop();
+        pop();
+        if (!nextElement(parser, '}', &done)) return false;
+    }
+    return true;
+}
+
+// parses one value and pushes it
+static bool parseValue(JsonParser* parser) {
+    parser->current = skipWhitespace(parser->current, parser->end);
+    if (parser->current == parser->end) return jsonError(parser, "Unexpected end of input.");
+
+    switch (*parser->current) {
+        case '{': return parseObject(parser);
+        case '[': return parseArray(parser);
+        case '"': return parseString(parser);
+        case 't': return parseLiteral(parser, "true", 4, BOOL_VAL(true));
+        case 'f': return parseLiteral(parser, "false", 5, BOOL_VAL(false));
+        case 'n': return parseLiteral(parser, "null", 4, NIL_VAL);
+        default:
+            if (*parser->current == '-' || isDigit(*parser->current)) return parseJsonNumber(parser);
+            return jsonError(parser, "Unexpected character.");
+    }
+}
+
+// jsonParse(string) returns the value the JSON text describes, objects become maps and null becomes nil
+static bool jsonParseNative(int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        runtimeError("Argument to jsonParse() must be a string.");
+        return false;
+    }
+
+    ObjString* text = AS_STRING(args[0]);
+    JsonParser parser;
+    parser.start = text->chars;
+    parser.current = text->chars;
+    parser.end = text->chars + text->length;
+    parser.depth = 0;
+    // a builder in the result slot, so the GC frees it even if an error means parsing never comes back
+    parser.buffer = newStringBuilder();
+    args[-1] = OBJ_VAL(parser.buffer);
+
+    bool valid = parseValue(&parser);
+    if (valid) {
+        parser.current = skipWhitespace(parser.current, parser.end);
+        if (parser.current != parser.end) {
+            valid = jsonError(&parser, "Unexpected data after value.");
+        } else {
+            args[-1] = pop();
+        }
+    }
+
+    return valid;
+}
+
+// =============== writer ===============
+
+typedef struct {
+    char* chars;
+    int length;
+    int capacity;
+    int depth;
+} JsonWriter;
+
+// the buffer becomes the result string with takeString(), so it's allocated like string chars. no
+// object owns it until then, so it's left with the VM to free if the script is abandoned, whether
+// for running out of memory or for text too long for a string
+static void reserve(JsonWriter* writer, int length) {
+    int64_t needed = (int64_t)writer->length + length + 1;
+    if (needed > INT32_MAX) {
+        runtimeError("jsonStringify() result is too long.");
+        throwRuntimeError();
+    }
+    if (writer->capacity < needed) {
+        int oldCapacity = writer->capacity;
+        int64_t capacity = GROW_CAPACITY((int64_t)oldCapacity);
+        while (capacity < needed) capacity *= 2;
+        if (capacity > INT32_MAX) capacity = INT32_MAX;
+        writer->chars = GROW_ARRAY(char, writer->chars, oldCapacity, capacity);
+        writer->capacity = (int)capacity;
+        vm.unownedChars = writer->chars;
+        vm.unownedSize = (size_t)writer->capacity;
+    }
+}
+
+static void writeChars(JsonWriter* writer, const char* chars, int length) {
+    reserve(writer, length);
+    memcpy(writer->chars + writer->length, chars, length);
+    writer->length += length;
+}
+
+static void writeString(JsonWriter* writer, ObjString* string) {
+    const char* current = string->chars;
+    const char* end = string->chars + string->length;
+
+    writeChars(writer, "\"", 1);
+    for (;;) {
+        // non-ASCII bytes are written as they are, only quotes, backslashes and control characters need escapes
+        const char* run = current;
+        for (;;) {
+            current = skipPlainChars(current, end);
+            if (current < end && (unsigned char)*current >= 0x80) {
+                current++;
+                continue;
+            }
+            break;
+        }
+        writeChars(writer, run, (int)(current - run));
+        if (current == end) break;
+
+        char escape[8];
+        unsigned char c = (unsigned char)*current++;
+        switch (c) {
+            case '"':  writeChars(writer, "\\\"", 2); break;
+            case '\\': writeChars(writer, "\\\\", 2); break;
+            case '\b': writeChars(writer, "\\b", 2); break;
+            case '\f': writeChars(writer, "\\f", 2); break;
+            case '\n': writeChars(writer, "\\n", 2); break;
+            case '\r': writeChars(writer, "\\r", 2); break;
+            case '\t': writeChars(writer, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                writeChars(writer, escape, 6);
+                break;
+        }
+    }
+    writeChars(writer, "\"", 1);
+}
+
+static bool writeValue(JsonWriter* writer, Value value) {
+    char number[32];
+
+    switch (VALUE_TYPE(value)) {
+        case VAL_NIL: writeChars(writer, "null", 4); return true;
+        case VAL_BOOL:
+            if (AS_BOOL(value)) {
+                writeChars(writer, "true", 4);
+            } else {
+                writeChars(writer, "false", 5);
+            }
+            return true;
+        case VAL_INT:
+            writeChars(writer, number, formatInt(AS_INT(value), number));
+            return true;
+        case VAL_NUMBER:
+            // JSON has no NaN or infinity
+            if (!isfinite(AS_NUMBER(value))) {
+                writeChars(writer, "null", 4);
+            } else {
+                writeChars(writer, number, formatNumber(AS_NUMBER(value), number));
+            }
+            return true;
+        case VAL_OBJ:
+            break;
+    }
+
+    if (IS_STRING(value)) {
+        writeString(writer, AS_STRING(value));
+        return true;
+    }
+
+    if (!IS_ARRAY(value) && !IS_MAP(value)) {
+        runtimeError("Only nil, booleans, numbers, strings, arrays and maps can be converted to JSON.");
+        return false;
+    }
+    if (++writer->depth > JSON_MAX_DEPTH) {
+        runtimeError("Value is nested too deeply to convert to JSON.");
+        return false;
+    }
+
+    if (IS_ARRAY(value)) {
+        ObjArray* array = AS_ARRAY(value);
+        writeChars(writer, "[", 1);
+        for (int i = 0; i < array->items.count; i++) {
+            if (i > 0) writeChars(writer, ",", 1);
+            if (!writeValue(writer, array->items.values[i])) return false;
+        }
+        writeChars(writer, "]", 1);
+    } else {
+        Table* table = &AS_MAP(value)->table;
+        bool first = true;
+        writeChars(writer, "{", 1);
+        for (int i = 0; i < table->capacity; i++) {
+            Entry* entry = &table->entries[i];
+            if (entry->key == NULL) continue;
+
+            if (!first) writeChars(writer, ",", 1);
+            first = false;
+            writeString(writer, entry->key);
+            writeChars(writer, ":", 1);
+            if (!writeValue(writer, entry->value)) return false;
+        }
+        writeChars(writer, "}", 1);
+    }
+
+    writer->depth--;
+    return true;
+}
+
+// jsonStringify(value) returns compact JSON text for the value
+static bool jsonStringifyNative(int argCount, Value* args) {
+    JsonWriter writer;
+    writer.chars = NULL;
+    writer.length = 0;
+    writer.capacity = 0;
+    writer.depth = 0;
+
+    if (!writeValue(&writer, args[0])) {
+        FREE_ARRAY(char, writer.chars, writer.capacity);
+        vm.unownedChars = NULL;
+        return false;
+    }
+
+    // shrink to fit so the string owns exactly length + 1 bytes
+    reserve(&writer, 0);
+    writer.chars = GROW_ARRAY(char, writer.chars, writer.capacity, writer.length + 1);
+    writer.chars[writer.length] = '\0';
+    args[-1] = OBJ_VAL(takeString(writer.chars, writer.length));
+    return true;
+}
+
+void defineJsonNatives() {
+    defineNative("jsonParse", jsonParseNative, 1);
+    defineNative("jsonStringify", jsonStringifyNative, 1);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_json_h
+#define clox_json_h
+
+void defineJsonNatives();
+
+#endif
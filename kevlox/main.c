@@ -56,6 +56,36 @@ static void runFile(const char* path) {
 }
 
 int main(int argc, const char* argv[]) {
+    // --max-heap=<megabytes> caps the heap, a script that needs more gets a runtime error.
+    // --arena=<megabytes> allocates that much before the first collection and frees it in one go
+    // at exit, for short runs that never need to collect. --huge-pages asks the kernel to back heap
+    // pages with 2 MB pages, for large heaps whose marking misses the TLB
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--huge-pages") == 0) {
+            vm.hugePages = true;
+            argc--;
+            argv++;
+            continue;
+        }
+
+        bool heap = strncmp(argv[1], "--max-heap=", 11) == 0;
+        if (!heap && strncmp(argv[1], "--arena=", 8) != 0) break;
+
+        char* end;
+        unsigned long long megabytes = strtoull(strchr(argv[1], '=') + 1, &end, 10);
+        if (*end != '\0' || megabytes == 0) {
+            fprintf(stderr, "%s must be a whole number of megabytes.\n", heap ? "Heap limit" : "Arena size");
+            exit(64);
+        }
+        if (heap) {
+            vm.heapLimit = (size_t)megabytes * 1024 * 1024;
+        } else {
+            vm.arenaLimit = (size_t)megabytes * 1024 * 1024;
+        }
+        argc--;
+        argv++;
+    }
+
     initVM();
 
     if (argc == 1) {
@@ -63,7 +93,7 @@ int main(int argc, const char* argv[]) {
     } else if (argc == 2) {
         runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--max-heap=<megabytes>] [--arena=<megabytes>] [--huge-pages] [path]\n");
         exit(64);
     }
 
@@ -0,0 +1,406 @@
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mathlib.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "vm.h"
+
+// scalar math natives, plus bulk operations over buffers of raw doubles. the bulk loops work
+// on two doubles at a time with SSE2 when it's available and finish odd elements one by one
+
+// =============== scalar ===============
+
+static bool numberError(const char* name) {
+    runtimeError("Arguments to %s() must be numbers.", name);
+    return false;
+}
+
+#define UNARY_MATH_NATIVE(name, function) \
+    static bool name##Native(int argCount, Value* args) { \
+        if (!IS_NUMBER(args[0])) return numberError(#name); \
+        args[-1] = NUMBER_VAL(function(AS_NUMBER(args[0]))); \
+        return true; \
+    }
+
+// whole results go back as integers so they stay on the VM's integer fast paths
+#define ROUNDING_MATH_NATIVE(name, function) \
+    static bool name##Native(int argCount, Value* args) { \
+        if (IS_INT(args[0])) { \
+            args[-1] = args[0]; \
+            return true; \
+        } \
+        if (!IS_NUMBER(args[0])) return numberError(#name); \
+        args[-1] = numberValue(function(AS_NUMBER(args[0]))); \
+        return true; \
+    }
+
+#define BINARY_MATH_NATIVE(name, function) \
+    static bool name##Native(int argCount, Value* args) { \
+        if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return numberError(#name); \
+        args[-1] = NUMBER_VAL(function(AS_NUMBER(args[0]), AS_NUMBER(args[1]))); \
+        return true; \
+    }
+
+UNARY_MATH_NATIVE(sqrt, sqrt)
+UNARY_MATH_NATIVE(exp, exp)
+UNARY_MATH_NATIVE(log, log)
+UNARY_MATH_NATIVE(sin, sin)
+UNARY_MATH_NATIVE(cos, cos)
+UNARY_MATH_NATIVE(tan, tan)
+UNARY_MATH_NATIVE(asin, asin)
+UNARY_MATH_NATIVE(acos, acos)
+UNARY_MATH_NATIVE(atan, atan)
+ROUNDING_MATH_NATIVE(floor, floor)
+ROUNDING_MATH_NATIVE(ceil, ceil)
+ROUNDING_MATH_NATIVE(round, round)
+BINARY_MATH_NATIVE(pow, pow)
+BINARY_MATH_NATIVE(atan2, atan2)
+
+#undef UNARY_MATH_NATIVE
+#undef ROUNDING_MATH_NATIVE
+#undef BINARY_MATH_NATIVE
+
+static bool absNative(int argCount, Value* args) {
+    if (IS_INT(args[0]) && AS_INT(args[0]) != INT32_MIN) {
+        args[-1] = INT_VAL(abs(AS_INT(args[0])));
+        return true;
+    }
+    if (!IS_NUMBER(args[0])) return numberError("abs");
+    args[-1] = NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+    return true;
+}
+
+// remainder with the sign of the dividend, like C's fmod
+static bool fmodNative(int argCount, Value* args) {
+    if (IS_INT(args[0]) && IS_INT(args[1]) && AS_INT(args[1]) != 0 && AS_INT(args[1]) != -1) {
+        int32_t remainder = AS_INT(args[0]) % AS_INT(args[1]);
+        // -0 has no integer encoding
+        if (remainder != 0 || AS_INT(args[0]) >= 0) {
+            args[-1] = INT_VAL(remainder);
+            return true;
+        }
+    }
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return numberError("fmod");
+    args[-1] = NUMBER_VAL(fmod(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    return true;
+}
+
+// min(...) and max(...) take one or more numbers and return one of them unchanged
+static bool extremum(int argCount, Value* args, const char* name, bool wantMax) {
+    if (argCount == 0) {
+        runtimeError("%s() needs at least one argument.", name);
+        return false;
+    }
+
+    Value best = args[0];
+    if (!IS_NUMBER(best)) return numberError(name);
+    for (int i = 1; i < argCount; i++) {
+        if (!IS_NUMBER(args[i])) return numberError(name);
+        bool better = wantMax ? AS_NUMBER(args[i]) > AS_NUMBER(best) : AS_NUMBER(args[i]) < AS_NUMBER(best);
+        if (better) best = args[i];
+    }
+    args[-1] = best;
+    return true;
+}
+
+static bool minNative(int argCount, Value* args) {
+    return extremum(argCount, args, "min", false);
+}
+
+static bool maxNative(int argCount, Value* args) {
+    return extremum(argCount, args, "max", true);
+}
+
+// =============== bitwise ===============
+
+// bitwise operands are 32 bit integers, whole doubles in range are accepted too
+static bool toInt32(Value value, const char* name, int32_t* result) {
+    if (IS_INT(value)) {
+        *result = AS_INT(value);
+        return true;
+    }
+
+    if (IS_DOUBLE(value)) {
+        double number = AS_NUMBER(value);
+        if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number) {
+            *result = (int32_t)number;
+            return true;
+        }
+    }
+    runtimeError("Arguments to %s() must be 32 bit integers.", name);
+    return false;
+}
+
+#define BITWISE_NATIVE(name, expression) \
+    static bool name##Native(int argCount, Value* args) { \
+        int32_t a; \
+        int32_t b; \
+        if (!toInt32(args[0], #name, &a) || !toInt32(args[1], #name, &b)) return false; \
+        args[-1] = INT_VAL(expression); \
+        return true; \
+    }
+
+BITWISE_NATIVE(band, a & b)
+BITWISE_NATIVE(bor, a | b)
+BITWISE_NATIVE(bxor, a ^ b)
+// shift counts wrap at 32 like in most languages, shl goes through unsigned to avoid overflow
+BITWISE_NATIVE(shl, (int32_t)((uint32_t)a << (b & 31)))
+BITWISE_NATIVE(shr, a >> (b & 31))
+
+#undef BITWISE_NATIVE
+
+// the result is unsigned, so it can be past the integer range
+static bool ushrNative(int argCount, Value* args) {
+    int32_t a;
+    int32_t b;
+    if (!toInt32(args[0], "ushr", &a) || !toInt32(args[1], "ushr", &b)) return false;
+    args[-1] = numberValue((double)((uint32_t)a >> (b & 31)));
+    return true;
+}
+
+static bool bnotNative(int argCount, Value* args) {
+    int32_t a;
+    if (!toInt32(args[0], "bnot", &a)) return false;
+    args[-1] = INT_VAL(~a);
+    return true;
+}
+
+// =============== buffers ===============
+
+static void addDoubles(double* out, const double* a, const double* b, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    #endif
+    for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static void subtractDoubles(double* out, const double* a, const double* b, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    #endif
+    for (; i < count; i++) out[i] = a[i] - b[i];
+}
+
+static void multiplyDoubles(double* out, const double* a, const double* b, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    #endif
+    for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+static void divideDoubles(double* out, const double* a, const double* b, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_div_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    #endif
+    for (; i < count; i++) out[i] = a[i] / b[i];
+}
+
+static void scaleDoubles(double* out, const double* a, double factor, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    __m128d factors = _mm_set1_pd(factor);
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factors));
+    }
+    #endif
+    for (; i < count; i++) out[i] = a[i] * factor;
+}
+
+static void sqrtDoubles(double* out, const double* a, int count) {
+    int i = 0;
+    #ifdef __SSE2__
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_sqrt_pd(_mm_loadu_pd(a + i)));
+    }
+    #endif
+    for (; i < count; i++) out[i] = sqrt(a[i]);
+}
+
+// two lanes summed separately then combined, so the result can differ from a
+// left to right sum in the last bits
+static double dotDoubles(const double* a, const double* b, int count) {
+    int i = 0;
+    double sum = 0;
+    #ifdef __SSE2__
+    __m128d sums = _mm_setzero_pd();
+    for (; i + 2 <= count; i += 2) {
+        sums = _mm_add_pd(sums, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, sums);
+    sum = lanes[0] + lanes[1];
+    #endif
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double sumDoubles(const double* a, int count) {
+    int i = 0;
+    double sum = 0;
+    #ifdef __SSE2__
+    __m128d sums = _mm_setzero_pd();
+    for (; i + 2 <= count; i += 2) sums = _mm_add_pd(sums, _mm_loadu_pd(a + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, sums);
+    sum = lanes[0] + lanes[1];
+    #endif
+    for (; i < count; i++) sum += a[i];
+    return sum;
+}
+
+// checks that the first count arguments are buffers of the same length
+static bool checkBuffers(Value* args, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (!IS_BUFFER(args[i])) {
+            runtimeError("Arguments to %s() must be buffers.", name);
+            return false;
+        }
+        if (AS_BUFFER(args[i])->count != AS_BUFFER(args[0])->count) {
+            runtimeError("Buffers passed to %s() must be the same length.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// buffer(count) returns a buffer of count zeros, buffer(array) copies an array of numbers
+static bool bufferNative(int argCount, Value* args) {
+    if (IS_ARRAY(args[0])) {
+        ValueArray* items = &AS_ARRAY(args[0])->items;
+        ObjBuffer* buffer = newBuffer(items->count);
+        args[-1] = OBJ_VAL(buffer);
+        for (int i = 0; i < items->count; i++) {
+            if (!IS_NUMBER(items->values[i])) {
+                runtimeError("Buffers only hold numbers.");
+                return false;
+            }
+            buffer->values[i] = AS_NUMBER(items->values[i]);
+        }
+        return true;
+    }
+
+    // in range before the cast, and NaN isn't
+    double length = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+    if (!(length >= 0 && length <= INT32_MAX) || length != (int)length) {
+        runtimeError("buffer() takes a length or an array of numbers.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newBuffer((int)length));
+    return true;
+}
+
+#define BUFFER_BINARY_NATIVE(name, loop) \
+    static bool name##Native(int argCount, Value* args) { \
+        if (!checkBuffers(args, 3, #name)) return false; \
+        loop(AS_BUFFER(args[0])->values, AS_BUFFER(args[1])->values, AS_BUFFER(args[2])->values, AS_BUFFER(args[0])->count); \
+        args[-1] = args[0]; \
+        return true; \
+    }
+
+// bufferAdd(out, a, b) and friends write a op b into out element by element and return out,
+// out may be one of the inputs
+BUFFER_BINARY_NATIVE(bufferAdd, addDoubles)
+BUFFER_BINARY_NATIVE(bufferSub, subtractDoubles)
+BUFFER_BINARY_NATIVE(bufferMul, multiplyDoubles)
+BUFFER_BINARY_NATIVE(bufferDiv, divideDoubles)
+
+#undef BUFFER_BINARY_NATIVE
+
+// bufferScale(out, a, factor) writes a * factor into out
+static bool bufferScaleNative(int argCount, Value* args) {
+    if (!checkBuffers(args, 2, "bufferScale")) return false;
+    if (!IS_NUMBER(args[2])) return numberError("bufferScale");
+    scaleDoubles(AS_BUFFER(args[0])->values, AS_BUFFER(args[1])->values, AS_NUMBER(args[2]), AS_BUFFER(args[0])->count);
+    args[-1] = args[0];
+    return true;
+}
+
+// bufferSqrt(out, a) writes the square root of each element of a into out
+static bool bufferSqrtNative(int argCount, Value* args) {
+    if (!checkBuffers(args, 2, "bufferSqrt")) return false;
+    sqrtDoubles(AS_BUFFER(args[0])->values, AS_BUFFER(args[1])->values, AS_BUFFER(args[0])->count);
+    args[-1] = args[0];
+    return true;
+}
+
+// bufferFill(out, number) sets every element of out
+static bool bufferFillNative(int argCount, Value* args) {
+    if (!checkBuffers(args, 1, "bufferFill")) return false;
+    if (!IS_NUMBER(args[1])) return numberError("bufferFill");
+
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    double number = AS_NUMBER(args[1]);
+    for (int i = 0; i < buffer->count; i++) buffer->values[i] = number;
+    args[-1] = args[0];
+    return true;
+}
+
+static bool bufferSumNative(int argCount, Value* args) {
+    if (!checkBuffers(args, 1, "bufferSum")) return false;
+    args[-1] = NUMBER_VAL(sumDoubles(AS_BUFFER(args[0])->values, AS_BUFFER(args[0])->count));
+    return true;
+}
+
+static bool bufferDotNative(int argCount, Value* args) {
+    if (!checkBuffers(args, 2, "bufferDot")) return false;
+    args[-1] = NUMBER_VAL(dotDoubles(AS_BUFFER(args[0])->values, AS_BUFFER(args[1])->values, AS_BUFFER(args[0])->count));
+    return true;
+}
+
+void defineMathNatives() {
+    defineNative("sqrt", sqrtNative, 1);
+    defineNative("pow", powNative, 2);
+    defineNative("exp", expNative, 1);
+    defineNative("log", logNative, 1);
+    defineNative("sin", sinNative, 1);
+    defineNative("cos", cosNative, 1);
+    defineNative("tan", tanNative, 1);
+    defineNative("asin", asinNative, 1);
+    defineNative("acos", acosNative, 1);
+    defineNative("atan", atanNative, 1);
+    defineNative("atan2", atan2Native, 2);
+    defineNative("floor", floorNative, 1);
+    defineNative("ceil", ceilNative, 1);
+    defineNative("round", roundNative, 1);
+    defineNative("abs", absNative, 1);
+    defineNative("fmod", fmodNative, 2);
+    defineNative("min", minNative, -1);
+    defineNative("max", maxNative, -1);
+
+    defineNative("band", bandNative, 2);
+    defineNative("bor", borNative, 2);
+    defineNative("bxor", bxorNative, 2);
+    defineNative("bnot", bnotNative, 1);
+    defineNative("shl", shlNative, 2);
+    defineNative("shr", shrNative, 2);
+    defineNative("ushr", ushrNative, 2);
+
+    defineNative("buffer", bufferNative, 1);
+    defineNative("bufferAdd", bufferAddNative, 3);
+    defineNative("bufferSub", bufferSubNative, 3);
+    defineNative("bufferMul", bufferMulNative, 3);
+    defineNative("bufferDiv", bufferDivNative, 3);
+    defineNative("bufferScale", bufferScaleNative, 3);
+    defineNative("bufferSqrt", bufferSqrtNative, 2);
+    defineNative("bufferFill", bufferFillNative, 2);
+    defineNative("bufferSum", bufferSumNative, 1);
+    defineNative("bufferDot", bufferDotNative, 2);
+}
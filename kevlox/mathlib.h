@@ -0,0 +1,6 @@
+#ifndef clox_mathlib_h
+#define clox_mathlib_h
+
+void defineMathNatives();
+
+#endif
@@ -1,39 +1,434 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "compiler.h"
+#include "dedup.h"
 #include "memory.h"
+#include "regex.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GRAY_STACK_KEPT 1024 // entries the gray stack keeps between collections
+
+static void printHeapSummary();
+
+// reports running out of memory and abandons the running script, this doesn't return
+static void memoryError(const char* format, size_t size) {
+    if (vm.frameCount > 0) {
+        runtimeError(format, size, vm.heapLimit);
+    } else {
+        // while compiling there's no frame to report
+        fprintf(stderr, format, size, vm.heapLimit);
+        fputs("\n", stderr);
+    }
+    printHeapSummary();
+    throwRuntimeError();
+}
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+// the allocation of size bytes can't be satisfied even after a full collection
+static void heapExhausted(size_t size) {
+    memoryError(vm.heapLimit != 0 && vm.bytesAllocated + size > vm.heapLimit
+        ? "Out of memory: %zu more bytes would pass the heap limit of %zu bytes."
+        : "Out of memory: the system couldn't provide %zu more bytes.", size);
+}
 
-    if (newSize > oldSize) {
-        #ifdef DEBUG_STRESS_GC
+// for memory the VM takes straight from malloc() rather than the heap, size bytes of which the
+// system couldn't provide. anything only the caller knows about has to be freed first
+void outOfMemory(size_t size) {
+    memoryError("Out of memory: the system couldn't provide %zu more bytes.", size);
+}
+
+// counts size more bytes against the heap, collecting first if it's time to. nextGC never goes
+// past the heap limit, so an allocation that would cross it always gets a full collection before
+// giving up
+static void chargeHeap(size_t size) {
+    vm.bytesAllocated += size;
+    #ifdef DEBUG_STRESS_GC
+    collectGarbage();
+    #endif
+    if (vm.bytesAllocated > vm.nextGC) {
         collectGarbage();
-        #endif
+    }
 
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+    if (vm.heapLimit != 0 && vm.bytesAllocated > vm.heapLimit) {
+        vm.bytesAllocated -= size;
+        heapExhausted(size);
+    }
+}
+
+// =============== arena ===============
+
+// with vm.arenaLimit set, memory comes out of one reservation of that many bytes: object pages from
+// the top down, everything else from the bottom up, and none of it is collected or freed. when the
+// two ends meet the arena closes, the GC takes over and new memory comes from malloc as usual.
+// what's in the arena stays there until freeObjects() unmaps all of it at once
+static void* arenaReservation = NULL;
+static char* arena = NULL;
+static size_t arenaSize = 0;
+static size_t arenaBottom = 0; // blocks are below this
+static size_t arenaTop = 0; // pages are at and above this
+static char* arenaLastBlock = NULL; // the block that ends at arenaBottom, which can be resized in place
+static bool arenaOpen = false;
+
+static inline bool inArena(void* pointer) {
+    return (char*)pointer >= arena && (char*)pointer < arena + arenaSize;
+}
+
+// opens the arena the first time it's asked for, it isn't reopened once it closes
+static bool arenaAvailable() {
+    if (arenaOpen) return true;
+    if (vm.arenaLimit == 0 || arenaReservation != NULL) return false;
+
+    arenaReservation = mmap(NULL, vm.arenaLimit + OBJ_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arenaReservation == MAP_FAILED) {
+        arenaReservation = NULL;
+        vm.arenaLimit = 0;
+        return false;
+    }
+    arena = (char*)(((uintptr_t)arenaReservation + OBJ_PAGE_SIZE - 1) & ~(uintptr_t)(OBJ_PAGE_SIZE - 1));
+    arenaSize = vm.arenaLimit & ~(size_t)(OBJ_PAGE_SIZE - 1);
+    arenaBottom = 0;
+    arenaTop = arenaSize;
+    arenaOpen = true;
+    if (vm.hugePages) madvise(arena, arenaSize, MADV_HUGEPAGE);
+    vm.nextGC = vm.heapLimit != 0 ? vm.heapLimit : SIZE_MAX; // a heap limit still gets its last collection
+    return true;
+}
+
+static void closeArena() {
+    arenaOpen = false;
+    vm.nextGC = vm.bytesAllocated; // collect at the next allocation
+}
+
+static void* arenaBlock(size_t size) {
+    size = (size + 15) & ~(size_t)15; // malloc's alignment
+    if (arenaTop - arenaBottom < size) {
+        closeArena();
+        return NULL;
+    }
+    arenaLastBlock = arena + arenaBottom;
+    arenaBottom += size;
+    return arenaLastBlock;
+}
+
+#ifndef POINTER_COMPRESSION // pages come from the cage instead
+static void* arenaPages(size_t bytes) {
+    if (arenaTop - arenaBottom < bytes) {
+        closeArena();
+        return NULL;
+    }
+    arenaTop -= bytes;
+    return arena + arenaTop;
+}
+#endif
+
+static void freeArena() {
+    if (arenaReservation != NULL) munmap(arenaReservation, vm.arenaLimit + OBJ_PAGE_SIZE);
+    arenaReservation = NULL;
+    arena = NULL;
+    arenaSize = 0;
+    arenaLastBlock = NULL;
+    arenaOpen = false;
+}
+
+// realloc() that knows about the arena: memory in it is never freed, and what's allocated while
+// it's open comes from it, growing the last block where it is when it can
+static void* resize(void* pointer, size_t oldSize, size_t newSize) {
+    if (!arenaAvailable() && !inArena(pointer)) return realloc(pointer, newSize);
+
+    void* result = NULL;
+    if (arenaOpen) {
+        if (pointer != NULL && pointer == arenaLastBlock) {
+            size_t end = ((char*)pointer - arena) + ((newSize + 15) & ~(size_t)15);
+            if (end <= arenaTop) {
+                arenaBottom = end;
+                return pointer;
+            }
         }
+        result = arenaBlock(newSize);
+    }
+    if (result == NULL) result = malloc(newSize);
+    if (result == NULL) return NULL;
+
+    if (pointer != NULL) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        if (!inArena(pointer)) free(pointer);
+    }
+    return result;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize > oldSize) {
+        chargeHeap(newSize - oldSize);
+    } else {
+        vm.bytesAllocated -= oldSize - newSize;
     }
 
     if (newSize == 0) { // dealloc
-        free(pointer);
+        if (!inArena(pointer)) free(pointer); // the arena is freed all at once
         return NULL;
     }
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1); // couldn't alloc enough memory
+    void* result = resize(pointer, oldSize, newSize);
+    if (result == NULL) {
+        // the system is out even though we're under the limit, see if a collection gives enough back
+        collectGarbage();
+        result = resize(pointer, oldSize, newSize);
+        if (result == NULL) {
+            vm.bytesAllocated -= newSize - oldSize;
+            heapExhausted(newSize > oldSize ? newSize - oldSize : 0);
+        }
+    }
     return result;
 }
 
+// =============== object pages ===============
+
+// an empty slot links to the next one of its size class after its header
+typedef struct {
+    Obj obj;
+    Obj* next;
+} FreeSlot;
+
+static inline ObjPage* pageOf(Obj* object) {
+    return (ObjPage*)((uintptr_t)object & ~(uintptr_t)(OBJ_PAGE_SIZE - 1));
+}
+
+static inline Obj* pageSlot(ObjPage* page, uint32_t index) {
+    return (Obj*)((char*)page + sizeof(ObjPage) + (size_t)index * page->slotSize);
+}
+
+static size_t pageBytes(int sizeClass, size_t slotSize) {
+    if (sizeClass != OBJ_LARGE_CLASS) return OBJ_PAGE_SIZE;
+    return (sizeof(ObjPage) + slotSize + OBJ_PAGE_SIZE - 1) & ~(size_t)(OBJ_PAGE_SIZE - 1);
+}
+
+// =============== cage ===============
+
+// the cage is one reservation that every page comes from, so with POINTER_COMPRESSION objects can
+// be named by their 32-bit offset from heapCage, and with vm.hugePages the kernel can back it with
+// 2 MB pages and the marker walks a heap that takes a few TLB entries instead of thousands. the
+// kernel only backs what gets touched, and freed pages keep their addresses for reuse: single pages
+// on a stack, runs of them for large objects first fit. their memory goes back to the kernel too,
+// except with huge pages, which that would split up
+#ifdef POINTER_COMPRESSION
+#define CAGE_SIZE ((size_t)4 << 30)
+#else
+#define CAGE_SIZE ((size_t)64 << 30)
+#endif
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef struct {
+    char* start;
+    size_t bytes;
+} CageRun;
+
+char* heapCage = NULL;
+static void* cageReservation = NULL;
+static size_t cageUsed = 0; // the cage past here has never been handed out
+static bool cageHugePages = false;
+static bool cageRefused = false; // the system wouldn't reserve it
+
+static char** freePages = NULL;
+static int freePageCount = 0;
+static int freePageCapacity = 0;
+static CageRun* freeRuns = NULL;
+static int freeRunCount = 0;
+static int freeRunCapacity = 0;
+
+static void* cageAlloc(size_t bytes) {
+    if (bytes == OBJ_PAGE_SIZE && freePageCount > 0) return freePages[--freePageCount];
+    for (int i = 0; i < freeRunCount; i++) {
+        CageRun* run = &freeRuns[i];
+        if (run->bytes < bytes) continue;
+        char* start = run->start;
+        run->start += bytes;
+        run->bytes -= bytes;
+        if (run->bytes == 0) freeRuns[i] = freeRuns[--freeRunCount];
+        return start;
+    }
+
+    if (heapCage == NULL) {
+        if (cageRefused) return NULL;
+        // reserved with room to round up to a huge page boundary
+        cageReservation = mmap(NULL, CAGE_SIZE + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (cageReservation == MAP_FAILED) {
+            cageReservation = NULL;
+            cageRefused = true;
+            #ifdef POINTER_COMPRESSION
+            fprintf(stderr, "Could not reserve %zu GB of address space for the heap.\n", CAGE_SIZE >> 30);
+            #else
+            fprintf(stderr, "Could not reserve %zu GB of address space for huge pages, using normal pages.\n",
+                    CAGE_SIZE >> 30);
+            vm.hugePages = false;
+            #endif
+            return NULL;
+        }
+        heapCage = (char*)(((uintptr_t)cageReservation + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (vm.hugePages) {
+            madvise(heapCage, CAGE_SIZE, MADV_HUGEPAGE);
+            cageHugePages = true;
+        }
+    }
+    if (CAGE_SIZE - cageUsed < bytes) return NULL;
+    char* start = heapCage + cageUsed;
+    cageUsed += bytes;
+    return start;
+}
+
+static inline bool inCage(void* pointer) {
+    return heapCage != NULL && (char*)pointer >= heapCage && (char*)pointer < heapCage + CAGE_SIZE;
+}
+
+static void cageFree(void* start, size_t bytes) {
+    if (!cageHugePages) madvise(start, bytes, MADV_DONTNEED);
+    // with no room to remember the pages their addresses aren't reused, but their memory still goes back
+    if (bytes == OBJ_PAGE_SIZE) {
+        if (freePageCapacity < freePageCount + 1) {
+            int capacity = GROW_CAPACITY(freePageCapacity);
+            char** grown = (char**)realloc(freePages, sizeof(char*) * capacity);
+            if (grown == NULL) {
+                if (cageHugePages) madvise(start, bytes, MADV_DONTNEED);
+                return;
+            }
+            freePages = grown;
+            freePageCapacity = capacity;
+        }
+        freePages[freePageCount++] = (char*)start;
+        return;
+    }
+    if (freeRunCapacity < freeRunCount + 1) {
+        int capacity = GROW_CAPACITY(freeRunCapacity);
+        CageRun* grown = (CageRun*)realloc(freeRuns, sizeof(CageRun) * capacity);
+        if (grown == NULL) {
+            if (cageHugePages) madvise(start, bytes, MADV_DONTNEED);
+            return;
+        }
+        freeRuns = grown;
+        freeRunCapacity = capacity;
+    }
+    freeRuns[freeRunCount++] = (CageRun){(char*)start, bytes};
+}
+
+static void freeCage() {
+    if (cageReservation != NULL) munmap(cageReservation, CAGE_SIZE + HUGE_PAGE_SIZE);
+    cageReservation = NULL;
+    heapCage = NULL;
+    cageUsed = 0;
+    cageHugePages = false;
+    cageRefused = false;
+    free(freePages);
+    freePages = NULL;
+    freePageCount = freePageCapacity = 0;
+    free(freeRuns);
+    freeRuns = NULL;
+    freeRunCount = freeRunCapacity = 0;
+}
+
+// pages come from the cage with POINTER_COMPRESSION, which also makes it the arena for pages. otherwise
+// they come from the arena while it's open, then from the cage with huge pages or aligned_alloc()
+static void* takePages(size_t bytes) {
+    #ifndef POINTER_COMPRESSION
+    if (arenaAvailable()) {
+        void* pages = arenaPages(bytes);
+        if (pages != NULL) return pages;
+    }
+    if (vm.hugePages) {
+        void* pages = cageAlloc(bytes);
+        if (pages != NULL) return pages;
+    }
+    return aligned_alloc(OBJ_PAGE_SIZE, bytes);
+    #else
+    return cageAlloc(bytes);
+    #endif
+}
+
+static void releasePages(void* pages, size_t bytes) {
+    if (inCage(pages)) {
+        cageFree(pages, bytes);
+    } else if (inArena(pages)) {
+        madvise(pages, bytes, MADV_DONTNEED); // the addresses aren't reused, only the memory
+    } else {
+        free(pages);
+    }
+}
+
+// a page for one large object, or a page of empty slots that go on the free list lowest address first
+static ObjPage* newPage(int sizeClass, size_t slotSize) {
+    size_t bytes = pageBytes(sizeClass, slotSize);
+
+    // the allocator's own memory, not managed by the GC
+    ObjPage* page = (ObjPage*)takePages(bytes);
+    if (page == NULL) return NULL;
+    page->slotSize = (uint32_t)slotSize;
+    page->slotCount = sizeClass == OBJ_LARGE_CLASS ? 1 : (uint32_t)((bytes - sizeof(ObjPage)) / slotSize);
+    page->next = vm.pages[sizeClass];
+    vm.pages[sizeClass] = page;
+
+    for (uint32_t i = page->slotCount; i-- > 0;) {
+        FreeSlot* slot = (FreeSlot*)pageSlot(page, i);
+        slot->obj.flags = OBJ_FLAG_FREE;
+        slot->next = vm.freeSlots[sizeClass];
+        vm.freeSlots[sizeClass] = (Obj*)slot;
+    }
+    return page;
+}
+
+static inline size_t slotSizeFor(size_t size) {
+    return size < sizeof(FreeSlot) ? sizeof(FreeSlot) : (size + 7) & ~(size_t)7;
+}
+
+// takes a slot off its size class's free list, adding a page if the list is empty
+static Obj* takeSlot(size_t slotSize) {
+    int sizeClass = slotSize <= OBJ_MAX_SLOT_SIZE ? (int)(slotSize / 8) : OBJ_LARGE_CLASS;
+    if (sizeClass == OBJ_LARGE_CLASS || vm.freeSlots[sizeClass] == NULL) {
+        if (newPage(sizeClass, slotSize) == NULL) {
+            // a collection may free a slot of this size or give the system some pages back
+            collectGarbage();
+            if ((sizeClass == OBJ_LARGE_CLASS || vm.freeSlots[sizeClass] == NULL) &&
+                newPage(sizeClass, slotSize) == NULL) {
+                vm.bytesAllocated -= slotSize;
+                heapExhausted(slotSize);
+            }
+        }
+    }
+    Obj* object = vm.freeSlots[sizeClass];
+    vm.freeSlots[sizeClass] = ((FreeSlot*)object)->next;
+    return object;
+}
+
+// returns an uninitialized object of at least size bytes, possibly collecting garbage first
+Obj* allocateSlot(size_t size) {
+    size_t slotSize = slotSizeFor(size);
+    chargeHeap(slotSize);
+    return takeSlot(slotSize);
+}
+
+// allocateSlot() for an object whose type has a pool, which every slot in the pool fits
+Obj* allocatePooled(Obj** pool, size_t size) {
+    size_t slotSize = slotSizeFor(size);
+    chargeHeap(slotSize); // a collection here refills the pool
+
+    Obj* object = *pool;
+    if (object == NULL) {
+        vm.poolMisses++;
+        return takeSlot(slotSize);
+    }
+    vm.poolHits++;
+    *pool = ((FreeSlot*)object)->next;
+    return object;
+}
+
+// =============== marking ===============
+
 void markObject(Obj* object) {
     if (object == NULL) return;
     if (object->isMarked) return;
@@ -47,12 +442,18 @@ void markObject(Obj* object) {
     object->isMarked = true;
 
     if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        int capacity = GROW_CAPACITY(vm.grayCapacity);
         // gray stack itself is not managed by the garbage collector
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        Obj** grown = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * capacity);
 
-        // allocation fails
-        if (vm.grayStack == NULL) exit(1);
+        // a collection can't be abandoned halfway, so the object stays marked without going on the
+        // stack and traceReferences() finds it again by scanning the heap
+        if (grown == NULL) {
+            vm.grayOverflow = true;
+            return;
+        }
+        vm.grayStack = grown;
+        vm.grayCapacity = capacity;
     }
 
     // add object to worklist
@@ -77,12 +478,22 @@ static void blackenObject(Obj* object) {
     printf("\n");
     #endif
 
-  switch (object->type) {
+  switch ((ObjType)object->type) {
+    case OBJ_ARRAY:
+      markArray(&((ObjArray*)object)->items);
+      break;
+    case OBJ_MAP:
+      markTable(&((ObjMap*)object)->table);
+      break;
+    case OBJ_REGEX:
+      markObject((Obj*)((ObjRegex*)object)->pattern);
+      break;
     case OBJ_CLOSURE: {
         ObjClosure* closure = (ObjClosure*)object;
         markObject((Obj*)closure->function);
         for (int i = 0; i < closure->upvalueCount; i++) {
-            markObject((Obj*)closure->upvalues[i]);
+            // captureUpvalue() can collect before they're all filled in
+            if (closure->upvalues[i] != NO_REF) markObject(REF_OBJ(closure->upvalues[i]));
         }
         break;
     }
@@ -95,46 +506,71 @@ static void blackenObject(Obj* object) {
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
+    case OBJ_BUFFER:
+    case OBJ_CSV_READER:
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
       break;
   }
 }
 
-void freeObject(Obj* object) {
-    
+// frees what the object owns and empties its slot
+static void freeObject(Obj* object) {
     #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
     #endif
 
-    switch (object->type) {
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+    switch ((ObjType)object->type) {
+        case OBJ_ARRAY:
+            freeValueArray(&((ObjArray*)object)->items);
+            break;
+        case OBJ_MAP:
+            freeTable(&((ObjMap*)object)->table);
+            break;
+        case OBJ_BUFFER: {
+            ObjBuffer* buffer = (ObjBuffer*)object;
+            FREE_ARRAY(double, buffer->values, buffer->count);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
-            break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length+1);
-            FREE(ObjString, object);
+            if (string->obj.flags & OBJ_FLAG_SHARED) {
+                releaseSharedChars(string);
+            } else {
+                FREE_ARRAY(char, string->chars, string->length+1);
+            }
+            break;
+        }
+        case OBJ_CSV_READER: {
+            ObjCsvReader* reader = (ObjCsvReader*)object;
+            if (reader->file != NULL) fclose(reader->file);
+            FREE_ARRAY(char, reader->buffer, reader->capacity);
+            FREE_ARRAY(CsvField, reader->fields, reader->fieldCapacity);
             break;
         }
+        case OBJ_REGEX:
+            freeRegexProgram(((ObjRegex*)object)->program);
+            break;
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)object;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            break;
+        }
+        case OBJ_CLOSURE: // upvalues are in the closure's slot
+        case OBJ_NATIVE:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
             break;
     }
 
-    free(vm.grayStack);
+    // the slot goes back on a free list at the end of the sweep
+    vm.bytesAllocated -= pageOf(object)->slotSize;
+    object->flags = OBJ_FLAG_FREE;
 }
 
 static void markRoots() {
@@ -157,32 +593,138 @@ static void markRoots() {
     markCompilerRoots();
 }
 
-// keep pulling out gray objects, traversing their references, and then marking them black
+// compiled regexes are cached for as long as their pattern string is reachable
+static void markRegexCache() {
+    for (int i = 0; i < vm.regexes.capacity; i++) {
+        Entry* entry = &vm.regexes.entries[i];
+        if (entry->key != NULL && entry->key->obj.isMarked) markValue(entry->value);
+    }
+}
+
+// blackens every marked object again after some didn't fit on the gray stack, so their children get
+// marked too. blackening an object twice does nothing more, and each pass that overflows has marked
+// more objects than the one before, so this ends
+static void blackenMarked() {
+    vm.grayOverflow = false;
+    for (int sizeClass = 0; sizeClass < OBJ_SIZE_CLASSES; sizeClass++) {
+        for (ObjPage* page = vm.pages[sizeClass]; page != NULL; page = page->next) {
+            for (uint32_t i = 0; i < page->slotCount; i++) {
+                Obj* object = pageSlot(page, i);
+                if (!(object->flags & OBJ_FLAG_FREE) && object->isMarked) blackenObject(object);
+            }
+        }
+    }
+}
+
+// how many objects are prefetched ahead of the one being marked, a power of two
+#define MARK_PREFETCH 8
+
+// keep pulling out gray objects, traversing their references, and then marking them black. objects
+// pass through a small FIFO on their way from the gray stack, prefetched as they go in, so by the
+// time one is blackened its fields are in the cache and the misses on the ones behind it overlap
 static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
+    Obj* fifo[MARK_PREFETCH];
+    int head = 0;
+    int count = 0;
+
+    for (;;) {
+        while (count < MARK_PREFETCH && vm.grayCount > 0) {
+            Obj* object = vm.grayStack[--vm.grayCount];
+            __builtin_prefetch(object);
+            fifo[(head + count) & (MARK_PREFETCH - 1)] = object;
+            count++;
+        }
+        if (count == 0) {
+            if (!vm.grayOverflow) return;
+            blackenMarked();
+            continue;
+        }
+
+        Obj* object = fifo[head];
+        head = (head + 1) & (MARK_PREFETCH - 1);
+        count--;
         blackenObject(object);
     }
 }
 
+// a string that lives through a second collection will probably stay around, so it gets its chars
+// merged with any equal string's
+static void ageString(ObjString* string) {
+    uint8_t flags = string->obj.flags;
+    if (flags & (OBJ_FLAG_INTERNED | OBJ_FLAG_SHARED)) return;
+    if (!(flags & OBJ_FLAG_OLD)) {
+        string->obj.flags |= OBJ_FLAG_OLD;
+    } else {
+        dedupString(string);
+    }
+}
+
+// puts the slot of an upvalue or closure that's just been freed in its pool. pooled slots keep
+// their page for a cycle so churning through closures doesn't give pages back and take them again
+// every collection, and if nothing takes them by the next sweep they go on the free lists
+static bool poolSlot(Obj* object) {
+    Obj** pool;
+    if (object->type == OBJ_UPVALUE) {
+        pool = &vm.upvaluePool;
+    } else if (object->type == OBJ_CLOSURE && ((ObjClosure*)object)->upvalueCount < CLOSURE_POOLS) {
+        pool = &vm.closurePools[((ObjClosure*)object)->upvalueCount];
+    } else {
+        return false;
+    }
+    object->flags = OBJ_FLAG_FREE | OBJ_FLAG_POOLED;
+    ((FreeSlot*)object)->next = *pool;
+    *pool = object;
+    return true;
+}
+
+// frees every unmarked object and rebuilds the free lists and pools from the empty slots, giving
+// back pages left with nothing on them
 static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) { // walk linked list
-        if (object->isMarked)
-        {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else { // free
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
+    vm.upvaluePool = NULL;
+    for (int i = 0; i < CLOSURE_POOLS; i++) vm.closurePools[i] = NULL;
+
+    for (int sizeClass = 0; sizeClass < OBJ_SIZE_CLASSES; sizeClass++) {
+        vm.freeSlots[sizeClass] = NULL;
+        ObjPage** link = &vm.pages[sizeClass];
+        while (*link != NULL) {
+            ObjPage* page = *link;
+            Obj* firstFree = NULL;
+            FreeSlot* lastFree = NULL;
+            uint32_t liveCount = 0;
+
+            for (uint32_t i = page->slotCount; i-- > 0;) {
+                Obj* object = pageSlot(page, i);
+                if (!(object->flags & OBJ_FLAG_FREE)) {
+                    if (object->isMarked) {
+                        object->isMarked = false;
+                        if (object->type == OBJ_STRING) ageString((ObjString*)object);
+                        liveCount++;
+                        continue;
+                    }
+                    freeObject(object);
+                    if (poolSlot(object)) {
+                        liveCount++; // not live, but the page stays for it
+                        continue;
+                    }
+                }
+                object->flags = OBJ_FLAG_FREE; // unused since it was pooled
+
+                FreeSlot* slot = (FreeSlot*)object;
+                slot->next = firstFree;
+                firstFree = object;
+                if (lastFree == NULL) lastFree = slot;
+            }
+
+            if (liveCount == 0) {
+                *link = page->next;
+                releasePages(page, pageBytes(sizeClass, page->slotSize));
+                continue;
             }
-            freeObject(unreached);
+            if (lastFree != NULL) {
+                lastFree->next = vm.freeSlots[sizeClass];
+                vm.freeSlots[sizeClass] = firstFree;
+            }
+            link = &page->next;
         }
     }
 }
@@ -195,10 +737,22 @@ void collectGarbage() {
 
     markRoots();
     traceReferences();
+    markRegexCache();
+    traceReferences();
+    tableRemoveWhite(&vm.regexes);
     tableRemoveWhite(&vm.strings);
+    dropDeferredStrings();
     sweep();
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // the gray stack is empty between collections, so a big one from marking a big heap goes back
+    if (vm.grayCapacity > GRAY_STACK_KEPT) {
+        free(vm.grayStack);
+        vm.grayStack = NULL;
+        vm.grayCapacity = 0;
+    }
+
+    vm.nextGC = arenaOpen ? SIZE_MAX : vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.heapLimit != 0 && vm.nextGC > vm.heapLimit) vm.nextGC = vm.heapLimit;
 
     #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -206,12 +760,61 @@ void collectGarbage() {
     #endif
 }
 
-// walk the linked list and free each node
+// frees every object and page
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for (int sizeClass = 0; sizeClass < OBJ_SIZE_CLASSES; sizeClass++) {
+        ObjPage* page = vm.pages[sizeClass];
+        while (page != NULL) {
+            ObjPage* next = page->next;
+            for (uint32_t i = 0; i < page->slotCount; i++) {
+                Obj* object = pageSlot(page, i);
+                if (!(object->flags & OBJ_FLAG_FREE)) freeObject(object);
+            }
+            releasePages(page, pageBytes(sizeClass, page->slotSize));
+            page = next;
+        }
+        vm.pages[sizeClass] = NULL;
+        vm.freeSlots[sizeClass] = NULL;
     }
-}
\ No newline at end of file
+    vm.upvaluePool = NULL;
+    for (int i = 0; i < CLOSURE_POOLS; i++) vm.closurePools[i] = NULL;
+
+    freeCage();
+    freeArena();
+    free(vm.grayStack);
+}
+
+// what's taking up the heap, for out of memory errors: live objects by type and the pages holding them
+static void printHeapSummary() {
+    static const char* typeNames[] = {
+        [OBJ_ARRAY] = "array", [OBJ_BUFFER] = "buffer", [OBJ_CLOSURE] = "closure",
+        [OBJ_CSV_READER] = "csv reader", [OBJ_FUNCTION] = "function", [OBJ_MAP] = "map",
+        [OBJ_NATIVE] = "native", [OBJ_REGEX] = "regex", [OBJ_STRING] = "string",
+        [OBJ_STRING_BUILDER] = "string builder", [OBJ_UPVALUE] = "upvalue",
+    };
+    size_t counts[OBJ_UPVALUE + 1] = {0};
+    size_t slotBytes[OBJ_UPVALUE + 1] = {0};
+    size_t pageCount = 0;
+    size_t totalPageBytes = 0;
+
+    for (int sizeClass = 0; sizeClass < OBJ_SIZE_CLASSES; sizeClass++) {
+        for (ObjPage* page = vm.pages[sizeClass]; page != NULL; page = page->next) {
+            pageCount++;
+            totalPageBytes += pageBytes(sizeClass, page->slotSize);
+            for (uint32_t i = 0; i < page->slotCount; i++) {
+                Obj* object = pageSlot(page, i);
+                if (object->flags & OBJ_FLAG_FREE) continue;
+                counts[object->type]++;
+                slotBytes[object->type] += page->slotSize;
+            }
+        }
+    }
+
+    fprintf(stderr, "heap: %zu bytes in use", vm.bytesAllocated);
+    if (vm.heapLimit != 0) fprintf(stderr, " of a %zu byte limit", vm.heapLimit);
+    fprintf(stderr, ", objects in %zu pages of %zu bytes\n", pageCount, totalPageBytes);
+    for (int type = 0; type <= OBJ_UPVALUE; type++) {
+        if (counts[type] == 0) continue;
+        fprintf(stderr, "  %-15s %10zu objects %12zu bytes of slots\n", typeNames[type], counts[type], slotBytes[type]);
+    }
+}
@@ -10,7 +10,28 @@
 #define GROW_ARRAY(type, pointer, oldCount, newCount) (type *)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0);
 
+// objects live in fixed size slots on pages that each hold one size class, every 8 bytes up to
+// OBJ_MAX_SLOT_SIZE, and bigger objects get a page to themselves. the sweeper finds objects by
+// walking the pages, so they don't need a list pointer
+#define OBJ_PAGE_SIZE (16 * 1024)
+#define OBJ_MAX_SLOT_SIZE 256
+#define OBJ_LARGE_CLASS (OBJ_MAX_SLOT_SIZE / 8 + 1)
+#define OBJ_SIZE_CLASSES (OBJ_LARGE_CLASS + 1)
+
+// closures with fewer upvalues than this are pooled by upvalue count
+#define CLOSURE_POOLS 8
+
+// page headers sit at OBJ_PAGE_SIZE aligned addresses with their slots right after them
+typedef struct ObjPage {
+    struct ObjPage* next; // next page of the same size class
+    uint32_t slotSize;
+    uint32_t slotCount;
+} ObjPage;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void outOfMemory(size_t size);
+Obj* allocateSlot(size_t size);
+Obj* allocatePooled(Obj** pool, size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
@@ -0,0 +1,411 @@
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "csv.h"
+#include "json.h"
+#include "mathlib.h"
+#include "memory.h"
+#include "natives.h"
+#include "number.h"
+#include "object.h"
+#include "regex.h"
+#include "sort.h"
+#include "stringlib.h"
+#include "vm.h"
+
+// natives receive their arguments in args[0..argCount-1] and write their result to args[-1]
+
+// =============== time ===============
+
+static uint64_t startNanos; // monotonic time when the natives were defined
+
+static uint64_t nanosNow(clockid_t clock) {
+    struct timespec time;
+    clock_gettime(clock, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+// returns wall clock time in seconds from a monotonic clock, so it isn't skewed by other processes or time changes
+static bool clockNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)(nanosNow(CLOCK_MONOTONIC) - startNanos) / 1e9);
+    return true;
+}
+
+// returns monotonic wall clock time in nanoseconds since the VM started
+static bool clockNanosNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)(nanosNow(CLOCK_MONOTONIC) - startNanos));
+    return true;
+}
+
+// returns the CPU time the process has used in seconds
+static bool cpuClockNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)nanosNow(CLOCK_PROCESS_CPUTIME_ID) / 1e9);
+    return true;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// bench(fn, iterations) calls fn with no arguments iterations times after a warmup,
+// prints the min and median time per call and returns the median in seconds
+static bool benchNative(int argCount, Value* args) {
+    if (!IS_CLOSURE(args[0]) && !IS_NATIVE(args[0])) {
+        runtimeError("First argument to bench() must be a function.");
+        return false;
+    }
+    double count = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : 0;
+    if (!isfinite(count) || count < 1 || count > INT_MAX || count != floor(count)) {
+        runtimeError("bench() needs a whole, positive number of iterations.");
+        return false;
+    }
+
+    Value function = args[0];
+    int iterations = (int)count;
+    int warmup = iterations / 10 + 1;
+
+    // a buffer in the result slot, so the timings are freed by the GC even if a call never comes back
+    ObjBuffer* buffer = newBuffer(iterations);
+    args[-1] = OBJ_VAL(buffer);
+    double* times = buffer->values;
+
+    for (int i = 0; i < warmup + iterations; i++) {
+        uint64_t start = nanosNow(CLOCK_MONOTONIC);
+        push(function);
+        if (!callFromNative(0)) return false;
+        pop();
+        uint64_t end = nanosNow(CLOCK_MONOTONIC);
+
+        if (i >= warmup) times[i - warmup] = (double)(end - start);
+    }
+
+    qsort(times, iterations, sizeof(double), compareDoubles);
+    double min = times[0];
+    double median = iterations % 2 == 1 ? times[iterations / 2]
+                                        : (times[iterations / 2 - 1] + times[iterations / 2]) / 2;
+
+    printf("bench: %d iterations, min %.3f us, median %.3f us\n", iterations, min / 1e3, median / 1e3);
+    args[-1] = NUMBER_VAL(median / 1e9);
+    return true;
+}
+
+// poolStats() returns an array of how many upvalues and closures came from the sweeper's pools
+// and how many had to take an ordinary free slot
+static bool poolStatsNative(int argCount, Value* args) {
+    ObjArray* stats = newArray();
+    args[-1] = OBJ_VAL(stats);
+    writeValueArray(&stats->items, NUMBER_VAL((double)vm.poolHits));
+    writeValueArray(&stats->items, NUMBER_VAL((double)vm.poolMisses));
+    return true;
+}
+
+// collect() runs a full collection and returns how many seconds it took
+static bool collectNative(int argCount, Value* args) {
+    uint64_t start = nanosNow(CLOCK_MONOTONIC);
+    collectGarbage();
+    args[-1] = NUMBER_VAL((double)(nanosNow(CLOCK_MONOTONIC) - start) / 1e9);
+    return true;
+}
+
+// =============== string builder ===============
+
+static bool stringBuilderNative(int argCount, Value* args) {
+    args[-1] = OBJ_VAL(newStringBuilder());
+    return true;
+}
+
+// append(builder, value) adds a string or the printed form of a number and returns the builder
+static bool appendNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[0])) {
+        runtimeError("First argument to append() must be a string builder.");
+        return false;
+    }
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+
+    if (IS_STRING(args[1])) {
+        ObjString* string = AS_STRING(args[1]);
+        appendStringBuilder(builder, string->chars, string->length);
+    } else if (IS_NUMBER(args[1])) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        int length = IS_INT(args[1]) ? formatInt(AS_INT(args[1]), buffer) : formatNumber(AS_NUMBER(args[1]), buffer);
+        appendStringBuilder(builder, buffer, length);
+    } else {
+        runtimeError("Can only append strings and numbers.");
+        return false;
+    }
+
+    args[-1] = args[0];
+    return true;
+}
+
+// toString(builder) copies the contents out once, however many appends built them
+static bool toStringNative(int argCount, Value* args) {
+    if (!IS_STRING_BUILDER(args[0])) {
+        runtimeError("Argument to toString() must be a string builder.");
+        return false;
+    }
+
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    args[-1] = OBJ_VAL(copyString(builder->chars != NULL ? builder->chars : "", builder->length));
+    return true;
+}
+
+// =============== numbers ===============
+
+// toNumber(value) returns a number unchanged and parses a string that is entirely a number,
+// anything else gives nil
+static bool toNumberNative(int argCount, Value* args) {
+    if (IS_NUMBER(args[0])) {
+        args[-1] = args[0];
+        return true;
+    }
+
+    args[-1] = NIL_VAL;
+    if (IS_STRING(args[0])) {
+        ObjString* string = AS_STRING(args[0]);
+        double value;
+        if (string->length > 0 && parseNumber(string->chars, string->chars + string->length, &value) == string->length) {
+            args[-1] = numberValue(value);
+        }
+    }
+    return true;
+}
+
+// =============== arrays and maps ===============
+
+// array(...) returns a new array holding its arguments
+static bool arrayNative(int argCount, Value* args) {
+    ObjArray* array = newArray();
+    args[-1] = OBJ_VAL(array); // the callee slot keeps it reachable while it grows
+    for (int i = 0; i < argCount; i++) {
+        writeValueArray(&array->items, args[i]);
+    }
+    return true;
+}
+
+static bool mapNative(int argCount, Value* args) {
+    args[-1] = OBJ_VAL(newMap());
+    return true;
+}
+
+// checks that index is a whole number below count
+static bool arrayIndex(int count, Value index, int* result) {
+    if (!IS_NUMBER(index)) {
+        runtimeError("Array index must be a number.");
+        return false;
+    }
+
+    double number = AS_NUMBER(index);
+    // NaN fails the range check, so the cast only ever sees numbers that fit
+    if (!(number >= 0 && number < count) || number != (int)number) {
+        runtimeError("Array index %g out of bounds.", number);
+        return false;
+    }
+
+    *result = (int)number;
+    return true;
+}
+
+// len(value) is the number of items in an array, buffer or map, or bytes in a string
+static bool lenNative(int argCount, Value* args) {
+    if (IS_ARRAY(args[0])) {
+        args[-1] = INT_VAL(AS_ARRAY(args[0])->items.count);
+    } else if (IS_BUFFER(args[0])) {
+        args[-1] = INT_VAL(AS_BUFFER(args[0])->count);
+    } else if (IS_MAP(args[0])) {
+        args[-1] = INT_VAL(AS_MAP(args[0])->table.count);
+    } else if (IS_STRING(args[0])) {
+        args[-1] = INT_VAL(AS_STRING(args[0])->length);
+    } else {
+        runtimeError("len() takes an array, buffer, map or string.");
+        return false;
+    }
+    return true;
+}
+
+// get(array, index), get(buffer, index) or get(map, key), a missing map key gives nil
+static bool getNative(int argCount, Value* args) {
+    int index;
+    if (IS_ARRAY(args[0])) {
+        if (!arrayIndex(AS_ARRAY(args[0])->items.count, args[1], &index)) return false;
+        args[-1] = AS_ARRAY(args[0])->items.values[index];
+    } else if (IS_BUFFER(args[0])) {
+        if (!arrayIndex(AS_BUFFER(args[0])->count, args[1], &index)) return false;
+        args[-1] = NUMBER_VAL(AS_BUFFER(args[0])->values[index]);
+    } else if (IS_MAP(args[0])) {
+        if (!IS_STRING(args[1])) {
+            runtimeError("Map keys must be strings.");
+            return false;
+        }
+        ObjString* key = findInterned(AS_STRING(args[1]));
+        if (key == NULL || !tableGet(&AS_MAP(args[0])->table, key, &args[-1])) args[-1] = NIL_VAL;
+    } else {
+        runtimeError("get() takes an array, buffer or map.");
+        return false;
+    }
+    return true;
+}
+
+// set(array, index, value), set(buffer, index, number) or set(map, key, value), returns the value
+static bool setNative(int argCount, Value* args) {
+    int index;
+    if (IS_ARRAY(args[0])) {
+        if (!arrayIndex(AS_ARRAY(args[0])->items.count, args[1], &index)) return false;
+        AS_ARRAY(args[0])->items.values[index] = args[2];
+    } else if (IS_BUFFER(args[0])) {
+        if (!arrayIndex(AS_BUFFER(args[0])->count, args[1], &index)) return false;
+        if (!IS_NUMBER(args[2])) {
+            runtimeError("Buffers only hold numbers.");
+            return false;
+        }
+        AS_BUFFER(args[0])->values[index] = AS_NUMBER(args[2]);
+    } else if (IS_MAP(args[0])) {
+        if (!IS_STRING(args[1])) {
+            runtimeError("Map keys must be strings.");
+            return false;
+        }
+        args[1] = OBJ_VAL(intern(AS_STRING(args[1]))); // the key stays in args while the table grows
+        tableSet(&AS_MAP(args[0])->table, AS_STRING(args[1]), args[2]);
+    } else {
+        runtimeError("set() takes an array, buffer or map.");
+        return false;
+    }
+    args[-1] = args[2];
+    return true;
+}
+
+// push(array, value) appends to the array and returns it
+static bool pushNative(int argCount, Value* args) {
+    if (!IS_ARRAY(args[0])) {
+        runtimeError("First argument to push() must be an array.");
+        return false;
+    }
+    writeValueArray(&AS_ARRAY(args[0])->items, args[1]);
+    args[-1] = args[0];
+    return true;
+}
+
+// keys(map) returns a new array of the map's keys
+static bool keysNative(int argCount, Value* args) {
+    if (!IS_MAP(args[0])) {
+        runtimeError("Argument to keys() must be a map.");
+        return false;
+    }
+
+    Table* table = &AS_MAP(args[0])->table;
+    ObjArray* keys = newArray();
+    args[-1] = OBJ_VAL(keys);
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) {
+            writeValueArray(&keys->items, OBJ_VAL(table->entries[i].key));
+        }
+    }
+    return true;
+}
+
+// =============== higher order ===============
+
+// these call back into Lox with callFromNative(). the callback can change the array, so its
+// length is read again on every step, and results live in the callee slot where the GC sees them
+
+static bool checkCallback(Value* args, const char* name) {
+    if (!IS_ARRAY(args[0])) {
+        runtimeError("First argument to %s() must be an array.", name);
+        return false;
+    }
+    if (!IS_CLOSURE(args[1]) && !IS_NATIVE(args[1])) {
+        runtimeError("Second argument to %s() must be a function.", name);
+        return false;
+    }
+    return true;
+}
+
+// calls fn(item) and leaves the result on top of the stack
+static bool callWithItem(Value function, ObjArray* array, int index) {
+    push(function);
+    push(array->items.values[index]);
+    return callFromNative(1);
+}
+
+// mapArray(array, fn) returns a new array of fn(item) for each item
+static bool mapArrayNative(int argCount, Value* args) {
+    if (!checkCallback(args, "mapArray")) return false;
+    ObjArray* array = AS_ARRAY(args[0]);
+
+    ObjArray* result = newArray();
+    args[-1] = OBJ_VAL(result);
+    for (int i = 0; i < array->items.count; i++) {
+        if (!callWithItem(args[1], array, i)) return false;
+        // still on the stack while the result array grows
+        writeValueArray(&result->items, vm.stackTop[-1]);
+        pop();
+    }
+    return true;
+}
+
+// filter(array, fn) returns a new array of the items for which fn(item) is truthy
+static bool filterNative(int argCount, Value* args) {
+    if (!checkCallback(args, "filter")) return false;
+    ObjArray* array = AS_ARRAY(args[0]);
+
+    ObjArray* result = newArray();
+    args[-1] = OBJ_VAL(result);
+    for (int i = 0; i < array->items.count; i++) {
+        if (!callWithItem(args[1], array, i)) return false;
+        Value keep = pop();
+        if (!IS_NIL(keep) && !(IS_BOOL(keep) && !AS_BOOL(keep))) {
+            writeValueArray(&result->items, array->items.values[i]);
+        }
+    }
+    return true;
+}
+
+// forEach(array, fn) calls fn(item) for each item and returns nil
+static bool forEachNative(int argCount, Value* args) {
+    if (!checkCallback(args, "forEach")) return false;
+    ObjArray* array = AS_ARRAY(args[0]);
+
+    for (int i = 0; i < array->items.count; i++) {
+        if (!callWithItem(args[1], array, i)) return false;
+        pop();
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+void defineNatives() {
+    startNanos = nanosNow(CLOCK_MONOTONIC);
+
+    defineNative("clock", clockNative, 0);
+    defineNative("clockNanos", clockNanosNative, 0);
+    defineNative("cpuClock", cpuClockNative, 0);
+    defineNative("bench", benchNative, 2);
+    defineNative("poolStats", poolStatsNative, 0);
+    defineNative("collect", collectNative, 0);
+    defineNative("stringBuilder", stringBuilderNative, 0);
+    defineNative("append", appendNative, 2);
+    defineNative("toString", toStringNative, 1);
+    defineNative("toNumber", toNumberNative, 1);
+    defineNative("array", arrayNative, -1);
+    defineNative("map", mapNative, 0);
+    defineNative("len", lenNative, 1);
+    defineNative("get", getNative, 2);
+    defineNative("set", setNative, 3);
+    defineNative("push", pushNative, 2);
+    defineNative("keys", keysNative, 1);
+    defineNative("mapArray", mapArrayNative, 2);
+    defineNative("filter", filterNative, 2);
+    defineNative("forEach", forEachNative, 2);
+
+    defineJsonNatives();
+    defineCsvNatives();
+    defineSortNatives();
+    defineMathNatives();
+    defineRegexNatives();
+    defineStringNatives();
+}
@@ -0,0 +1,6 @@
+#ifndef clox_natives_h
+#define clox_natives_h
+
+void defineNatives();
+
+#endif
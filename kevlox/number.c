@@ -0,0 +1,487 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "number.h"
+
+// number text to double and back, shared by the compiler, printing, toNumber() and the JSON and CSV natives.
+// parsing uses Clinger's fast path: up to 19 digits fit a uint64, and when that mantissa fits in a double's
+// 53 bits and the power of ten is at most 22 both are exact, so one multiply or divide is correctly rounded.
+// anything else goes to strtod. formatting prints whole numbers directly and uses Grisu3 for the rest,
+// which finds the shortest digits that read back as the same double in integer arithmetic, or says it
+// can't be sure, and then printf decides. either way the output is the shortest %g that round trips
+
+static const double powersOfTen[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// strtod needs a terminated copy, since text past end may continue the number (or be hex)
+static double slowParse(const char* start, int length) {
+    char digits[64];
+    char* copy = length < (int)sizeof(digits) ? digits : (char*)malloc(length + 1);
+    if (copy == NULL) outOfMemory(length + 1);
+    memcpy(copy, start, length);
+    copy[length] = '\0';
+
+    double result = strtod(copy, NULL);
+    if (copy != digits) free(copy);
+    return result;
+}
+
+int parseNumber(const char* start, const char* end, double* result) {
+    const char* current = start;
+    bool negative = false;
+    if (current < end && *current == '-') {
+        negative = true;
+        current++;
+    }
+    if (current == end || !isDigit(*current)) return 0;
+
+    uint64_t mantissa = 0;
+    int digits = 0;       // significant digits in mantissa
+    int dropped = 0;      // digits after the 19th, which don't fit
+    int exponent = 0;
+
+    for (; current < end && isDigit(*current); current++) {
+        if (mantissa == 0 && *current == '0') continue;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*current - '0');
+            digits++;
+        } else {
+            dropped++;
+            exponent++;
+        }
+    }
+
+    if (current + 1 < end && *current == '.' && isDigit(current[1])) {
+        for (current++; current < end && isDigit(*current); current++) {
+            if (mantissa == 0 && *current == '0') {
+                exponent--;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*current - '0');
+                digits++;
+                exponent--;
+            } else {
+                dropped++;
+            }
+        }
+    }
+
+    if (current < end && (*current == 'e' || *current == 'E')) {
+        const char* mark = current++;
+        bool negativeExponent = false;
+        if (current < end && (*current == '+' || *current == '-')) negativeExponent = *current++ == '-';
+
+        if (current < end && isDigit(*current)) {
+            int written = 0;
+            for (; current < end && isDigit(*current); current++) {
+                // clamped, anything this big is zero or infinity anyway
+                if (written < 100000) written = written * 10 + (*current - '0');
+            }
+            exponent += negativeExponent ? -written : written;
+        } else {
+            current = mark; // "1e" is the number 1 followed by something else
+        }
+    }
+
+    int length = (int)(current - start);
+    if (mantissa == 0) {
+        *result = negative ? -0.0 : 0.0;
+    } else if (dropped == 0 && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+        *result = negative ? -value : value;
+    } else {
+        *result = slowParse(start, length);
+    }
+    return length;
+}
+
+// =============== shortest digits (Grisu3) ===============
+
+// f * 2^e
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+typedef struct {
+    uint64_t f;
+    int16_t e;
+    int16_t decimalExponent;
+} CachedPower;
+
+// 10^k for every eighth k, as 64 bit significands rounded to nearest
+static const CachedPower cachedPowers[] = {
+    {0xfa8fd5a0081c0288ull, -1220, -348},
+    {0xbaaee17fa23ebf76ull, -1193, -340},
+    {0x8b16fb203055ac76ull, -1166, -332},
+    {0xcf42894a5dce35eaull, -1140, -324},
+    {0x9a6bb0aa55653b2dull, -1113, -316},
+    {0xe61acf033d1a45dfull, -1087, -308},
+    {0xab70fe17c79ac6caull, -1060, -300},
+    {0xff77b1fcbebcdc4full, -1034, -292},
+    {0xbe5691ef416bd60cull, -1007, -284},
+    {0x8dd01fad907ffc3cull, -980, -276},
+    {0xd3515c2831559a83ull, -954, -268},
+    {0x9d71ac8fada6c9b5ull, -927, -260},
+    {0xea9c227723ee8bcbull, -901, -252},
+    {0xaecc49914078536dull, -874, -244},
+    {0x823c12795db6ce57ull, -847, -236},
+    {0xc21094364dfb5637ull, -821, -228},
+    {0x9096ea6f3848984full, -794, -220},
+    {0xd77485cb25823ac7ull, -768, -212},
+    {0xa086cfcd97bf97f4ull, -741, -204},
+    {0xef340a98172aace5ull, -715, -196},
+    {0xb23867fb2a35b28eull, -688, -188},
+    {0x84c8d4dfd2c63f3bull, -661, -180},
+    {0xc5dd44271ad3cdbaull, -635, -172},
+    {0x936b9fcebb25c996ull, -608, -164},
+    {0xdbac6c247d62a584ull, -582, -156},
+    {0xa3ab66580d5fdaf6ull, -555, -148},
+    {0xf3e2f893dec3f126ull, -529, -140},
+    {0xb5b5ada8aaff80b8ull, -502, -132},
+    {0x87625f056c7c4a8bull, -475, -124},
+    {0xc9bcff6034c13053ull, -449, -116},
+    {0x964e858c91ba2655ull, -422, -108},
+    {0xdff9772470297ebdull, -396, -100},
+    {0xa6dfbd9fb8e5b88full, -369, -92},
+    {0xf8a95fcf88747d94ull, -343, -84},
+    {0xb94470938fa89bcfull, -316, -76},
+    {0x8a08f0f8bf0f156bull, -289, -68},
+    {0xcdb02555653131b6ull, -263, -60},
+    {0x993fe2c6d07b7facull, -236, -52},
+    {0xe45c10c42a2b3b06ull, -210, -44},
+    {0xaa242499697392d3ull, -183, -36},
+    {0xfd87b5f28300ca0eull, -157, -28},
+    {0xbce5086492111aebull, -130, -20},
+    {0x8cbccc096f5088ccull, -103, -12},
+    {0xd1b71758e219652cull, -77, -4},
+    {0x9c40000000000000ull, -50, 4},
+    {0xe8d4a51000000000ull, -24, 12},
+    {0xad78ebc5ac620000ull, 3, 20},
+    {0x813f3978f8940984ull, 30, 28},
+    {0xc097ce7bc90715b3ull, 56, 36},
+    {0x8f7e32ce7bea5c70ull, 83, 44},
+    {0xd5d238a4abe98068ull, 109, 52},
+    {0x9f4f2726179a2245ull, 136, 60},
+    {0xed63a231d4c4fb27ull, 162, 68},
+    {0xb0de65388cc8ada8ull, 189, 76},
+    {0x83c7088e1aab65dbull, 216, 84},
+    {0xc45d1df942711d9aull, 242, 92},
+    {0x924d692ca61be758ull, 269, 100},
+    {0xda01ee641a708deaull, 295, 108},
+    {0xa26da3999aef774aull, 322, 116},
+    {0xf209787bb47d6b85ull, 348, 124},
+    {0xb454e4a179dd1877ull, 375, 132},
+    {0x865b86925b9bc5c2ull, 402, 140},
+    {0xc83553c5c8965d3dull, 428, 148},
+    {0x952ab45cfa97a0b3ull, 455, 156},
+    {0xde469fbd99a05fe3ull, 481, 164},
+    {0xa59bc234db398c25ull, 508, 172},
+    {0xf6c69a72a3989f5cull, 534, 180},
+    {0xb7dcbf5354e9beceull, 561, 188},
+    {0x88fcf317f22241e2ull, 588, 196},
+    {0xcc20ce9bd35c78a5ull, 614, 204},
+    {0x98165af37b2153dfull, 641, 212},
+    {0xe2a0b5dc971f303aull, 667, 220},
+    {0xa8d9d1535ce3b396ull, 694, 228},
+    {0xfb9b7cd9a4a7443cull, 720, 236},
+    {0xbb764c4ca7a44410ull, 747, 244},
+    {0x8bab8eefb6409c1aull, 774, 252},
+    {0xd01fef10a657842cull, 800, 260},
+    {0x9b10a4e5e9913129ull, 827, 268},
+    {0xe7109bfba19c0c9dull, 853, 276},
+    {0xac2820d9623bf429ull, 880, 284},
+    {0x80444b5e7aa7cf85ull, 907, 292},
+    {0xbf21e44003acdd2dull, 933, 300},
+    {0x8e679c2f5e44ff8full, 960, 308},
+    {0xd433179d9c8cb841ull, 986, 316},
+    {0x9e19db92b4e31ba9ull, 1013, 324},
+    {0xeb96bf6ebadf77d9ull, 1039, 332},
+    {0xaf87023b9bf0ee6bull, 1066, 340},
+};
+
+#define CACHED_POWERS_MIN_DECIMAL -348
+#define CACHED_POWERS_DECIMAL_STEP 8
+// products scaled into this binary exponent range keep the integral part within 32 bits
+#define GRISU_MIN_EXPONENT -60
+#define GRISU_MAX_EXPONENT -32
+
+static DiyFp multiplyDiyFp(DiyFp x, DiyFp y) {
+    uint64_t a = x.f >> 32, b = x.f & 0xffffffff;
+    uint64_t c = y.f >> 32, d = y.f & 0xffffffff;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (1u << 31); // rounds the dropped half
+    DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+    return result;
+}
+
+static DiyFp normalizeDiyFp(DiyFp x) {
+    while (!(x.f & (1ull << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// walks the last digit down towards w while that stays inside the safe interval, then checks the
+// result is provably the closest shortest representation. false means Grisu3 can't tell
+static bool roundWeed(char* digits, int length, uint64_t distanceTooHighW, uint64_t unsafeInterval,
+                      uint64_t rest, uint64_t tenKappa, uint64_t unit) {
+    uint64_t smallDistance = distanceTooHighW - unit;
+    uint64_t bigDistance = distanceTooHighW + unit;
+
+    while (rest < smallDistance && unsafeInterval - rest >= tenKappa &&
+           (rest + tenKappa < smallDistance || smallDistance - rest >= rest + tenKappa - smallDistance)) {
+        digits[length - 1]--;
+        rest += tenKappa;
+    }
+
+    if (rest < bigDistance && unsafeInterval - rest >= tenKappa &&
+        (rest + tenKappa < bigDistance || bigDistance - rest > rest + tenKappa - bigDistance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafeInterval - 4 * unit;
+}
+
+static bool digitGen(DiyFp low, DiyFp w, DiyFp high, char* digits, int* length, int* kappa) {
+    uint64_t unit = 1;
+    DiyFp tooLow = {low.f - unit, low.e};
+    DiyFp tooHigh = {high.f + unit, high.e};
+    uint64_t unsafeInterval = tooHigh.f - tooLow.f;
+    int shift = -w.e;
+    uint64_t one = 1ull << shift;
+
+    uint32_t integrals = (uint32_t)(tooHigh.f >> shift);
+    uint64_t fractionals = tooHigh.f & (one - 1);
+
+    uint32_t divisor = 1;
+    *kappa = 0;
+    if (integrals != 0) {
+        *kappa = 1;
+        while (divisor <= integrals / 10) {
+            divisor *= 10;
+            (*kappa)++;
+        }
+    }
+
+    *length = 0;
+    while (*kappa > 0) {
+        digits[(*length)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafeInterval) {
+            return roundWeed(digits, *length, tooHigh.f - w.f, unsafeInterval, rest, (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafeInterval *= 10;
+        digits[(*length)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        (*kappa)--;
+
+        if (fractionals < unsafeInterval) {
+            return roundWeed(digits, *length, (tooHigh.f - w.f) * unit, unsafeInterval, fractionals, one, unit);
+        }
+        // can't happen for doubles, but digits only has room for 17
+        if (*length == 17) return false;
+    }
+}
+
+// shortest digits that read back as number (positive and finite), with the decimal exponent of the
+// last digit. false when Grisu3 can't prove its answer, about 0.5% of doubles
+static bool grisu3(double number, char* digits, int* length, int* decimalExponent) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    uint64_t fraction = bits & ((1ull << 52) - 1);
+    int biasedExponent = (int)(bits >> 52) & 0x7ff;
+
+    DiyFp v;
+    if (biasedExponent == 0) {
+        v.f = fraction;
+        v.e = 1 - 1075;
+    } else {
+        v.f = fraction | (1ull << 52);
+        v.e = biasedExponent - 1075;
+    }
+
+    // halfway to the neighbouring doubles, the lower one is closer at a power of two
+    DiyFp plus = normalizeDiyFp((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp minus;
+    if (fraction == 0 && biasedExponent > 1) {
+        minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+    } else {
+        minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    DiyFp w = normalizeDiyFp(v);
+
+    // pick the cached power that scales w into the target exponent range
+    int minExponent = GRISU_MIN_EXPONENT - (w.e + 64);
+    int k = (int)ceil((minExponent + 63) * 0.30102999566398114);
+    int index = (k - CACHED_POWERS_MIN_DECIMAL - 1) / CACHED_POWERS_DECIMAL_STEP + 1;
+    int count = (int)(sizeof(cachedPowers) / sizeof(cachedPowers[0]));
+    if (index < 0) index = 0;
+    if (index >= count) index = count - 1;
+    while (index + 1 < count && w.e + cachedPowers[index].e + 64 < GRISU_MIN_EXPONENT) index++;
+    while (index > 0 && w.e + cachedPowers[index].e + 64 > GRISU_MAX_EXPONENT) index--;
+
+    DiyFp power = {cachedPowers[index].f, cachedPowers[index].e};
+    int kappa;
+    bool found = digitGen(multiplyDiyFp(minus, power), multiplyDiyFp(w, power), multiplyDiyFp(plus, power),
+                          digits, length, &kappa);
+    *decimalExponent = kappa - cachedPowers[index].decimalExponent;
+    return found;
+}
+
+// =============== formatting ===============
+
+int formatInt(int32_t number, char* buffer) {
+    // digits come out backwards, so build them at the end of a scratch array
+    char digits[12];
+    char* current = digits + sizeof(digits);
+    uint32_t magnitude = number < 0 ? 0u - (uint32_t)number : (uint32_t)number;
+    do {
+        *--current = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (number < 0) *--current = '-';
+
+    int length = (int)(digits + sizeof(digits) - current);
+    memcpy(buffer, current, length);
+    buffer[length] = '\0';
+    return length;
+}
+
+// writes digits (significant digits, the first one worth 10^exponent) the way %.<precision>g would,
+// with trailing zeros already trimmed from digits
+static int writeDigits(char* buffer, bool negative, const char* digits, int count, int exponent, int precision) {
+    char* out = buffer;
+    if (negative) *out++ = '-';
+
+    if (exponent < -4 || exponent >= precision) {
+        *out++ = digits[0];
+        if (count > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, count - 1);
+            out += count - 1;
+        }
+        out += snprintf(out, 8, "e%c%02d", exponent < 0 ? '-' : '+', exponent < 0 ? -exponent : exponent);
+        return (int)(out - buffer);
+    }
+
+    if (exponent < 0) {
+        *out++ = '0';
+        *out++ = '.';
+        for (int i = -1; i > exponent; i--) *out++ = '0';
+        memcpy(out, digits, count);
+        out += count;
+    } else {
+        for (int i = 0; i <= exponent; i++) *out++ = i < count ? digits[i] : '0';
+        if (count > exponent + 1) {
+            *out++ = '.';
+            memcpy(out, digits + exponent + 1, count - exponent - 1);
+            out += count - exponent - 1;
+        }
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+int formatNumber(double number, char* buffer) {
+    if (isnan(number)) return snprintf(buffer, NUMBER_BUFFER_SIZE, "nan");
+    if (isinf(number)) return snprintf(buffer, NUMBER_BUFFER_SIZE, number < 0 ? "-inf" : "inf");
+
+    // whole numbers below 1e15 print as plain digits, the same as %.15g would
+    if (number == floor(number) && fabs(number) < 1e15) {
+        if (number == 0) return snprintf(buffer, NUMBER_BUFFER_SIZE, signbit(number) ? "-0" : "0");
+        if (number >= INT32_MIN && number <= INT32_MAX) return formatInt((int32_t)number, buffer);
+        return snprintf(buffer, NUMBER_BUFFER_SIZE, "%lld", (long long)number);
+    }
+
+    char digits[17];
+    int count;
+    int decimalExponent;
+    if (grisu3(fabs(number), digits, &count, &decimalExponent)) {
+        while (count > 1 && digits[count - 1] == '0') {
+            count--;
+            decimalExponent++;
+        }
+        // %.15g would print anything with up to 15 digits, longer ones need exactly their own length
+        return writeDigits(buffer, number < 0, digits, count, decimalExponent + count - 1, count > 15 ? count : 15);
+    }
+
+    // Grisu3 gave up, so fall back to printf
+
+    // subnormals hold fewer significant digits than the rounding below assumes, search them the slow way
+    if (fabs(number) < DBL_MIN) {
+        int length = 0;
+        for (int precision = 1; precision <= 17; precision++) {
+            length = snprintf(buffer, NUMBER_BUFFER_SIZE, "%.*g", precision, number);
+            if (strtod(buffer, NULL) == number) break;
+        }
+        return length;
+    }
+
+    // one printf gives 25 significant digits, rounding those to 15, 16 and 17 digits gives the same
+    // as printf would for each (barring a tie hidden past the 25th digit), and 17 always reads back
+    char exact[40];
+    snprintf(exact, sizeof(exact), "%.24e", fabs(number));
+    char all[25];
+    all[0] = exact[0];
+    memcpy(all + 1, exact + 2, 24);
+    int exponent = atoi(exact + 27);
+
+    for (int precision = 15; precision <= 17; precision++) {
+        int digitExponent = exponent;
+        memcpy(digits, all, precision);
+
+        // ties go to even like printf, as far as 25 digits can tell
+        bool tie = all[precision] == '5';
+        for (int i = precision + 1; tie && i < 25; i++) tie = all[i] == '0';
+        if (all[precision] > '5' || (all[precision] == '5' && (!tie || (digits[precision - 1] - '0') % 2 == 1))) {
+            int i = precision - 1;
+            while (i >= 0 && digits[i] == '9') digits[i--] = '0';
+            if (i >= 0) {
+                digits[i]++;
+            } else {
+                // 9.99... rounded up to 10
+                digits[0] = '1';
+                digitExponent++;
+            }
+        }
+
+        count = precision;
+        while (count > 1 && digits[count - 1] == '0') count--;
+
+        int length = writeDigits(buffer, number < 0, digits, count, digitExponent, precision);
+        double back;
+        if (precision == 17 || (parseNumber(buffer, buffer + length, &back) == length && back == number)) return length;
+    }
+    return 0; // unreachable, 17 digits always round trip
+}
+
+Value numberValue(double number) {
+    if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number && !(number == 0 && signbit(number))) {
+        return INT_VAL((int32_t)number);
+    }
+    return NUMBER_VAL(number);
+}
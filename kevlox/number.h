@@ -0,0 +1,21 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+#include "value.h"
+
+// enough for any formatNumber() output and its terminator
+#define NUMBER_BUFFER_SIZE 32
+
+// parses an optional '-', digits, an optional fraction and an optional exponent starting at start,
+// never reading at or past end. returns the number of bytes parsed, 0 if there's no number there
+int parseNumber(const char* start, const char* end, double* result);
+
+// writes the shortest text that reads back as exactly number, returns its length
+int formatNumber(double number, char* buffer);
+int formatInt(int32_t number, char* buffer);
+
+// whole numbers in int32 range become VAL_INT, like number literals do
+Value numberValue(double number);
+
+#endif
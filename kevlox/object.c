@@ -7,17 +7,14 @@
 #include "table.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(type, objectType) (type*)allocateObject(sizeof(type), objectType, NULL)
 
-// allocates an object of the given size on the heap
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+// allocates an object of the given size in a heap slot, from pool if it's given one
+static Obj* allocateObject(size_t size, ObjType type, Obj** pool) {
+    Obj* object = pool == NULL ? allocateSlot(size) : allocatePooled(pool, size);
     object->type = type;
     object->isMarked = false;
-
-    // add previous object to next (for garbage collection)
-    object->next = vm.objects;
-    vm.objects = object;
+    object->flags = 0;
 
     #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -26,41 +23,129 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
+ObjArray* newArray() {
+    ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    initValueArray(&array->items);
+    return array;
+}
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+// zero filled
+ObjBuffer* newBuffer(int count) {
+    // the buffer comes first so the values are never left unowned if allocating them fails
+    ObjBuffer* buffer = ALLOCATE_OBJ(ObjBuffer, OBJ_BUFFER);
+    buffer->count = 0;
+    buffer->values = NULL;
+    push(OBJ_VAL(buffer));
+    double* values = ALLOCATE(double, count);
+    for (int i = 0; i < count; i++) values[i] = 0;
+    buffer->values = values;
+    buffer->count = count;
+    pop();
+    return buffer;
+}
+
+ObjClosure* newClosure(ObjFunction* function) {
+    size_t size = sizeof(ObjClosure) + sizeof(ObjRef) * function->upvalueCount;
+    Obj** pool = function->upvalueCount < CLOSURE_POOLS ? &vm.closurePools[function->upvalueCount] : NULL;
+    ObjClosure* closure = (ObjClosure*)allocateObject(size, OBJ_CLOSURE, pool);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NO_REF;
+    }
     return closure;
 }
 
+ObjCsvReader* newCsvReader(FILE* file) {
+    ObjCsvReader* reader = ALLOCATE_OBJ(ObjCsvReader, OBJ_CSV_READER);
+    reader->file = file;
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->length = 0;
+    reader->position = 0;
+    reader->fields = NULL;
+    reader->fieldCount = 0;
+    reader->fieldCapacity = 0;
+    reader->row = 0;
+    return reader;
+}
+
 // blank state function pointer
 ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjMap* newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initTable(&map->table);
+    return map;
+}
+
+ObjNative* newNative(NativeFn function, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
   return native;
 }
 
+ObjRegex* newRegex(ObjString* pattern, struct RegexProgram* program) {
+    ObjRegex* regex = ALLOCATE_OBJ(ObjRegex, OBJ_REGEX);
+    regex->pattern = pattern;
+    regex->program = program;
+    return regex;
+}
+
+ObjStringBuilder* newStringBuilder() {
+    ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+// amortized growth, the builder must be reachable by the GC since growing can collect. a builder
+// too long to become a string abandons the script like running out of memory does
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length) {
+    int64_t needed = (int64_t)builder->length + length;
+    if (needed > INT32_MAX - 1) {
+        runtimeError("String builder is too long.");
+        throwRuntimeError();
+    }
+    if (builder->capacity < needed) {
+        int oldCapacity = builder->capacity;
+        int64_t capacity = GROW_CAPACITY((int64_t)oldCapacity);
+        while (capacity < needed) capacity *= 2;
+        if (capacity > INT32_MAX) capacity = INT32_MAX;
+        builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+        builder->capacity = (int)capacity;
+    }
+
+    memcpy(builder->chars + builder->length, chars, length);
+    builder->length += length;
+}
+
+// chars belong to nothing until the object exists, so they're left with the VM to free in case
+// allocating it runs out of memory
 static ObjString* allocateString(char* chars, int length, uint32_t hash) {
+    vm.unownedChars = chars;
+    vm.unownedSize = (size_t)length + 1;
     ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    vm.unownedChars = NULL;
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    return string;
+}
 
+// makes string the interned one with its contents, there mustn't be one already
+static ObjString* addInterned(ObjString* string) {
+    string->obj.flags |= OBJ_FLAG_INTERNED;
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
@@ -78,8 +163,17 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-// allocate a new array on the heap
+// copies chars into a new string. strings made at runtime aren't interned, so most of them never
+// touch vm.strings, and the GC merges the chars of equal ones that stick around
 ObjString* copyString(const char* chars, int length) {
+    char* heapChars = ALLOCATE(char, length+1);
+    memcpy(heapChars, chars, length);
+    heapChars[length] = '\0';
+    return allocateString(heapChars, length, hashString(chars, length));
+}
+
+// the interned string with these contents, for identifiers and literals
+ObjString* internString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
     // look in the string table first
@@ -89,11 +183,35 @@ ObjString* copyString(const char* chars, int length) {
     char* heapChars = ALLOCATE(char, length+1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return addInterned(allocateString(heapChars, length, hash));
+}
+
+// the interned string equal to string, which becomes it if there isn't one. tables compare keys
+// by address so every key goes through here. string has to be reachable
+ObjString* intern(ObjString* string) {
+    if (string->obj.flags & OBJ_FLAG_INTERNED) return string;
+
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+    if (interned != NULL) return interned;
+    return addInterned(string);
+}
+
+// the interned string equal to string, or NULL when there isn't one and so no table has it as a key
+ObjString* findInterned(ObjString* string) {
+    if (string->obj.flags & OBJ_FLAG_INTERNED) return string;
+    return tableFindString(&vm.strings, string->chars, string->length, string->hash);
+}
+
+bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    // two interned strings are only equal if they're the same string
+    if ((a->obj.flags & b->obj.flags) & OBJ_FLAG_INTERNED) return false;
+    if (a->length != b->length || a->hash != b->hash) return false;
+    return a->chars == b->chars || memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+    ObjUpvalue* upvalue = (ObjUpvalue*)allocateObject(sizeof(ObjUpvalue), OBJ_UPVALUE, &vm.upvaluePool);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
@@ -110,30 +228,65 @@ static void printFunction(ObjFunction* function) {
 
 // take ownership of a string
 ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    return allocateString(chars, length, hashString(chars, length));
+}
+
+static void printArray(ObjArray* array) {
+    printf("[");
+    for (int i = 0; i < array->items.count; i++) {
+        if (i > 0) printf(", ");
+        printValue(array->items.values[i]);
+    }
+    printf("]");
+}
+
+static void printMap(ObjMap* map) {
+    printf("{");
+    bool first = true;
+    for (int i = 0; i < map->table.capacity; i++) {
+        Entry* entry = &map->table.entries[i];
+        if (entry->key == NULL) continue;
 
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+        if (!first) printf(", ");
+        first = false;
+        printf("%s: ", entry->key->chars);
+        printValue(entry->value);
     }
-    return allocateString(chars, length, hash);
+    printf("}");
 }
 
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
+        case OBJ_ARRAY:
+            printArray(AS_ARRAY(value));
+            break;
+        case OBJ_MAP:
+            printMap(AS_MAP(value));
+            break;
+        case OBJ_BUFFER:
+            printf("<buffer %d>", AS_BUFFER(value)->count);
+            break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_CSV_READER:
+            printf("<csv reader>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_REGEX:
+            printf("<regex %s>", AS_REGEX(value)->pattern->chars);
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
+        case OBJ_STRING_BUILDER:
+            printf("<string builder>");
+            break;
         case OBJ_UPVALUE:
             printf("^upvalue^");
             break;
@@ -1,36 +1,66 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "chunk.h"
+#include "table.h"
 #include "value.h"
 
 // extract the object type tag from given value
-#define OBJ_TYPE(value)     (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)     ((ObjType)AS_OBJ(value)->type)
 
+#define IS_ARRAY(value)     isObjType(value, OBJ_ARRAY)
+#define IS_BUFFER(value)    isObjType(value, OBJ_BUFFER)
 #define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
-#define IS_FUNCTION(value)  isObjType(valye, OBJ_FUNCTION)
+#define IS_CSV_READER(value) isObjType(value, OBJ_CSV_READER)
+#define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
+#define IS_MAP(value)       isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
+#define IS_REGEX(value)     isObjType(value, OBJ_REGEX)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
+#define AS_ARRAY(value)     ((ObjArray*)AS_OBJ(value))
+#define AS_BUFFER(value)    ((ObjBuffer*)AS_OBJ(value))
 #define AS_CLOSURE(value)   ((ObjClosure*)AS_OBJ(value))
+#define AS_CSV_READER(value) ((ObjCsvReader*)AS_OBJ(value))
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value)    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_MAP(value)       ((ObjMap*)AS_OBJ(value))
+#define AS_NATIVE(value)    ((ObjNative*)AS_OBJ(value))
+#define AS_REGEX(value)     ((ObjRegex*)AS_OBJ(value))
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 
 typedef enum {
+    OBJ_ARRAY,
+    OBJ_BUFFER,
     OBJ_CLOSURE,
+    OBJ_CSV_READER,
     OBJ_FUNCTION,
+    OBJ_MAP,
     OBJ_NATIVE,
+    OBJ_REGEX,
     OBJ_STRING,
+    OBJ_STRING_BUILDER,
     OBJ_UPVALUE,
 } ObjType;
 
+// flags bits
+#define OBJ_FLAG_FREE 0x01 // an empty allocator slot, not an object
+#define OBJ_FLAG_INTERNED 0x02 // a string in vm.strings, the one string with its contents there
+#define OBJ_FLAG_OLD 0x04 // a string that's lived through a collection
+#define OBJ_FLAG_SHARED 0x08 // a string whose chars belong to the dedup table and may be shared
+#define OBJ_FLAG_POOLED 0x10 // an empty slot in vm.upvaluePool or vm.closurePools
+
+// the header is 4 bytes, so a type that starts with a 4 byte field keeps it in the header's word.
+// there's no list pointer, the allocator's pages say where every object is
 struct Obj {
-    ObjType type;
+    uint8_t type; // ObjType
     bool isMarked;
-    struct Obj* next;
+    uint8_t flags;
 };
 
 // function are first class so they need to be objects
@@ -38,14 +68,18 @@ typedef struct {
     Obj obj;
     int arity; // number of params the function expects
     int upvalueCount;
+    int maxStack; // most stack slots the function ever uses, callee and arguments included (computed by the compiler)
     Chunk chunk;
     ObjString* name; // function name
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// natives store their result in args[-1], the callee's slot, and return true
+// on failure they report with runtimeError() and return false
+typedef bool (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
     Obj obj;
+    int arity; // -1 accepts any number of arguments
     NativeFn function;
 } ObjNative;
 
@@ -58,6 +92,62 @@ struct ObjString {
     uint32_t hash; // O(n)
 };
 
+// growable list of values stored contiguously
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjArray;
+
+// fixed size array of raw doubles for bulk math, no per-element Value tags
+typedef struct {
+    Obj obj;
+    int count;
+    double* values;
+} ObjBuffer;
+
+// hash map from strings to values
+typedef struct {
+    Obj obj;
+    Table table; // never has deletions, so table.count is the number of entries
+} ObjMap;
+
+// compiled regular expression, the program is only touched by regex.c
+typedef struct {
+    Obj obj;
+    ObjString* pattern;
+    struct RegexProgram* program;
+} ObjRegex;
+
+// mutable buffer for building a string piece by piece without interning every intermediate result
+typedef struct {
+    Obj obj;
+    int length;
+    int capacity;
+    char* chars; // not null terminated
+} ObjStringBuilder;
+
+// slice of a CSV reader's buffer holding one field of the current row
+typedef struct {
+    int start;
+    int length;
+    bool escaped; // quoted field with "" pairs still to be collapsed
+} CsvField;
+
+// reads a CSV file one row at a time into a fixed buffer, the reader doubles as the current row
+// so fields are only turned into strings when asked for
+typedef struct {
+    Obj obj;
+    FILE* file;     // NULL once the whole file has been read or the reader is closed
+    char* buffer;
+    int capacity;
+    int length;     // bytes of file data in the buffer
+    int position;   // start of the next row in the buffer
+    CsvField* fields; // fields of the current row
+    int fieldCount;
+    int fieldCapacity;
+    int row;        // number of rows read so far
+} ObjCsvReader;
+
 // values from enclosing environment
 typedef struct ObjUpvalue {
     Obj obj;
@@ -66,18 +156,44 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
+// an object referenced from inside another. with POINTER_COMPRESSION it's the object's 32-bit
+// offset in the heap cage, otherwise a plain pointer. NO_REF is never an object in either
+#ifdef POINTER_COMPRESSION
+typedef uint32_t ObjRef;
+#define OBJ_REF(object) ((ObjRef)((char*)(object) - heapCage))
+#define REF_OBJ(ref)    ((Obj*)(heapCage + (ref)))
+#else
+typedef Obj* ObjRef;
+#define OBJ_REF(object) ((Obj*)(object))
+#define REF_OBJ(ref)    (ref)
+#endif
+#define NO_REF ((ObjRef)0)
+
 typedef struct {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues; // dynamically allocated array of pointers to upvalues
     int upvalueCount;
+    ObjFunction* function;
+    ObjRef upvalues[]; // allocated in the same slot as the closure
 } ObjClosure;
 
+#define CLOSURE_UPVALUE(closure, index) ((ObjUpvalue*)REF_OBJ((closure)->upvalues[index]))
+
+ObjArray* newArray();
+ObjBuffer* newBuffer(int count);
 ObjClosure* newClosure(ObjFunction* function);
+ObjCsvReader* newCsvReader(FILE* file);
 ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
+ObjMap* newMap();
+ObjNative* newNative(NativeFn function, int arity);
+ObjRegex* newRegex(ObjString* pattern, struct RegexProgram* program);
+ObjStringBuilder* newStringBuilder();
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* internString(const char* chars, int length);
+ObjString* intern(ObjString* string);
+ObjString* findInterned(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
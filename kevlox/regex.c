@@ -0,0 +1,999 @@
+#define _GNU_SOURCE // for memmem()
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "regex.h"
+#include "vm.h"
+
+// regular expressions are compiled to a small program and run by a Pike VM, which steps every live
+// thread over the subject together one byte at a time. there's at most one thread per instruction,
+// so matching takes time linear in the subject whatever the pattern, and nothing can backtrack
+// catastrophically.
+//
+// patterns have literals, ., [classes] with ranges and ^ negation, \d \w \s \D \W \S \b \B, \n \r \t,
+// escaped metacharacters, ^ and $ for the start and end of the subject, (groups), (?:groups),
+// alternation, and * + ? {n} {n,} {n,m} with lazy forms. matching is on bytes and leftmost-first,
+// which is what Perl and JavaScript do.
+//
+// compiled regexes are cached in vm.regexes by pattern string, so passing the same pattern string
+// again, or a regex() object, never recompiles it
+
+#define REGEX_MAX_INSTRUCTIONS 4096
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_GROUPS 32
+#define REGEX_MAX_NESTING 200
+#define REGEX_MAX_PREFIX 32
+
+typedef enum {
+    RX_CHAR,
+    RX_ANY,
+    RX_CLASS,
+    RX_SPLIT,
+    RX_JUMP,
+    RX_LOOP,
+    RX_SAVE,
+    RX_BOL,
+    RX_EOL,
+    RX_WORD_BOUNDARY,
+    RX_NOT_WORD_BOUNDARY,
+    RX_MATCH,
+} RegexOp;
+
+typedef struct {
+    uint8_t op;
+    int x; // byte, class index, slot, or jump target (the preferred one for a split)
+    int y; // the other split target, or where a loop exits
+} RegexInst;
+
+typedef struct {
+    uint8_t bits[32];
+} ByteSet;
+
+typedef struct RegexProgram RegexProgram;
+
+struct RegexProgram {
+    RegexInst* code;
+    int count;
+    ByteSet* classes;
+    int classCount;
+    int slotCount; // a start and end slot for the whole match and each group
+
+    // what a match can start with, to skip ahead over positions that can't start one
+    char prefix[REGEX_MAX_PREFIX]; // bytes every match starts with
+    int prefixLength;
+    ByteSet firstBytes;
+    int firstByte; // the only byte in firstBytes, or -1
+    bool canSkip; // false if the pattern can match the empty string
+    bool anchored; // every match starts at ^
+    bool hasBolPath; // some match starts at ^
+
+    // matcher scratch, matching never runs Lox code so one set per program is enough
+    int* visited; // generation that last added each instruction to a thread list
+    int generation;
+    int* threadPcs[2];
+    int* threadSlots[2];
+    int* startSlots;
+};
+
+static inline void addByte(ByteSet* set, int byte) {
+    set->bits[byte >> 3] |= (uint8_t)(1 << (byte & 7));
+}
+
+static inline bool hasByte(const ByteSet* set, int byte) {
+    return (set->bits[byte >> 3] >> (byte & 7)) & 1;
+}
+
+static inline bool isWordByte(int byte) {
+    return (byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') ||
+           (byte >= '0' && byte <= '9') || byte == '_';
+}
+
+static void compilerOutOfMemory(size_t size);
+
+// doubles an array that's out of room, not Lox values so not managed by the GC
+static void* growArray(void* array, int* capacity, int count, size_t size) {
+    if (count < *capacity) return array;
+    int grownCapacity = *capacity < 8 ? 8 : *capacity * 2;
+    void* grown = realloc(array, size * grownCapacity);
+    if (grown == NULL) compilerOutOfMemory(size * grownCapacity);
+    *capacity = grownCapacity;
+    return grown;
+}
+
+// =============== parser ===============
+
+typedef enum {
+    NODE_CHAR,
+    NODE_ANY,
+    NODE_CLASS,
+    NODE_BOL,
+    NODE_EOL,
+    NODE_WORD_BOUNDARY,
+    NODE_NOT_WORD_BOUNDARY,
+    NODE_CONCAT,
+    NODE_ALTERNATE,
+    NODE_GROUP,
+    NODE_REPEAT,
+} NodeType;
+
+// concatenations and alternations keep their children in a list through next, so long patterns
+// don't make deep trees
+typedef struct {
+    NodeType type;
+    int value; // byte, class index or group number
+    int child; // first child, or the only one for groups and repeats
+    int next; // next sibling
+    int min;
+    int max; // -1 when unbounded
+    bool greedy;
+} Node;
+
+typedef struct {
+    const char* current;
+    const char* end;
+    const char* error;
+    int depth;
+    Node* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int classCapacity;
+    int codeCapacity;
+    int groupCount;
+    RegexProgram* program;
+} RegexCompiler;
+
+// the compile in progress, freed if memory runs out partway through it
+static RegexCompiler* compiling = NULL;
+
+static void compilerOutOfMemory(size_t size) {
+    if (compiling != NULL) {
+        free(compiling->nodes);
+        freeRegexProgram(compiling->program);
+        compiling = NULL;
+    }
+    outOfMemory(size);
+}
+
+static int fail(RegexCompiler* compiler, const char* message) {
+    if (compiler->error == NULL) compiler->error = message;
+    return -1;
+}
+
+static int addNode(RegexCompiler* compiler, NodeType type, int value) {
+    compiler->nodes = growArray(compiler->nodes, &compiler->nodeCapacity, compiler->nodeCount, sizeof(Node));
+    Node* node = &compiler->nodes[compiler->nodeCount];
+    node->type = type;
+    node->value = value;
+    node->child = -1;
+    node->next = -1;
+    node->min = 0;
+    node->max = 0;
+    node->greedy = true;
+    return compiler->nodeCount++;
+}
+
+static int addClass(RegexCompiler* compiler, ByteSet* set) {
+    RegexProgram* program = compiler->program;
+    program->classes = growArray(program->classes, &compiler->classCapacity, program->classCount, sizeof(ByteSet));
+    program->classes[program->classCount] = *set;
+    return program->classCount++;
+}
+
+static void addRange(ByteSet* set, int from, int to) {
+    for (int byte = from; byte <= to; byte++) addByte(set, byte);
+}
+
+// \d \w \s and their negations, false for anything else
+static bool addShorthandClass(ByteSet* set, char escape) {
+    ByteSet shorthand = {{0}};
+    switch (escape | 0x20) {
+        case 'd':
+            addRange(&shorthand, '0', '9');
+            break;
+        case 'w':
+            for (int byte = 0; byte < 256; byte++) {
+                if (isWordByte(byte)) addByte(&shorthand, byte);
+            }
+            break;
+        case 's':
+            addRange(&shorthand, '\t', '\r');
+            addByte(&shorthand, ' ');
+            break;
+        default:
+            return false;
+    }
+
+    bool negated = escape >= 'A' && escape <= 'Z';
+    for (int i = 0; i < 32; i++) set->bits[i] |= negated ? (uint8_t)~shorthand.bits[i] : shorthand.bits[i];
+    return true;
+}
+
+// the byte an escape that isn't a class or an assertion stands for
+static int escapedByte(char escape) {
+    switch (escape) {
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+        default: return (uint8_t)escape;
+    }
+}
+
+// parses a bracketed class after its '['
+static int parseClass(RegexCompiler* compiler) {
+    ByteSet set = {{0}};
+    bool negated = false;
+    if (compiler->current < compiler->end && *compiler->current == '^') {
+        negated = true;
+        compiler->current++;
+    }
+
+    bool first = true;
+    for (;;) {
+        if (compiler->current >= compiler->end) return fail(compiler, "missing ]");
+        char c = *compiler->current++;
+        if (c == ']' && !first) break;
+        first = false;
+
+        int low = (uint8_t)c;
+        if (c == '\\') {
+            if (compiler->current >= compiler->end) return fail(compiler, "trailing \\");
+            char escape = *compiler->current++;
+            if (addShorthandClass(&set, escape)) continue;
+            low = escape == 'b' ? '\b' : escapedByte(escape);
+        }
+
+        // a range, unless the '-' is last in the class
+        if (compiler->current + 1 < compiler->end && compiler->current[0] == '-' && compiler->current[1] != ']') {
+            compiler->current++;
+            char d = *compiler->current++;
+            int high = (uint8_t)d;
+            if (d == '\\') {
+                if (compiler->current >= compiler->end) return fail(compiler, "trailing \\");
+                char escape = *compiler->current++;
+                if (escape == 'd' || escape == 'w' || escape == 's' ||
+                    escape == 'D' || escape == 'W' || escape == 'S') {
+                    return fail(compiler, "class shorthand in a range");
+                }
+                high = escape == 'b' ? '\b' : escapedByte(escape);
+            }
+            if (high < low) return fail(compiler, "range out of order");
+            addRange(&set, low, high);
+        } else {
+            addByte(&set, low);
+        }
+    }
+
+    if (negated) {
+        for (int i = 0; i < 32; i++) set.bits[i] = (uint8_t)~set.bits[i];
+    }
+    return addNode(compiler, NODE_CLASS, addClass(compiler, &set));
+}
+
+static int parseAlternation(RegexCompiler* compiler);
+
+static int parseAtom(RegexCompiler* compiler) {
+    char c = *compiler->current++;
+    switch (c) {
+        case '(': {
+            if (++compiler->depth > REGEX_MAX_NESTING) return fail(compiler, "groups nested too deeply");
+            int group = -1;
+            if (compiler->end - compiler->current >= 2 && compiler->current[0] == '?' && compiler->current[1] == ':') {
+                compiler->current += 2;
+            } else {
+                if (compiler->groupCount >= REGEX_MAX_GROUPS) return fail(compiler, "too many groups");
+                group = ++compiler->groupCount;
+            }
+
+            int inner = parseAlternation(compiler);
+            if (inner < 0) return -1;
+            if (compiler->current >= compiler->end || *compiler->current != ')') return fail(compiler, "missing )");
+            compiler->current++;
+            compiler->depth--;
+            if (group < 0) return inner;
+
+            int node = addNode(compiler, NODE_GROUP, group);
+            compiler->nodes[node].child = inner;
+            return node;
+        }
+        case '[':
+            return parseClass(compiler);
+        case '.':
+            return addNode(compiler, NODE_ANY, 0);
+        case '^':
+            return addNode(compiler, NODE_BOL, 0);
+        case '$':
+            return addNode(compiler, NODE_EOL, 0);
+        case '*':
+        case '+':
+        case '?':
+            return fail(compiler, "nothing to repeat");
+        case '\\': {
+            if (compiler->current >= compiler->end) return fail(compiler, "trailing \\");
+            char escape = *compiler->current++;
+            if (escape == 'b') return addNode(compiler, NODE_WORD_BOUNDARY, 0);
+            if (escape == 'B') return addNode(compiler, NODE_NOT_WORD_BOUNDARY, 0);
+
+            ByteSet set = {{0}};
+            if (addShorthandClass(&set, escape)) return addNode(compiler, NODE_CLASS, addClass(compiler, &set));
+            return addNode(compiler, NODE_CHAR, escapedByte(escape));
+        }
+        default:
+            return addNode(compiler, NODE_CHAR, (uint8_t)c);
+    }
+}
+
+static bool parseCount(RegexCompiler* compiler, int* count) {
+    if (compiler->current >= compiler->end || *compiler->current < '0' || *compiler->current > '9') return false;
+    int value = 0;
+    while (compiler->current < compiler->end && *compiler->current >= '0' && *compiler->current <= '9') {
+        if (value <= REGEX_MAX_REPEAT) value = value * 10 + (*compiler->current - '0');
+        compiler->current++;
+    }
+    *count = value;
+    return true;
+}
+
+// {n}, {n,} or {n,m} after its '{'. anything else leaves current alone and the '{' is a literal
+static bool parseBraces(RegexCompiler* compiler, int* min, int* max) {
+    const char* start = compiler->current;
+    if (parseCount(compiler, min)) {
+        *max = *min;
+        if (compiler->current < compiler->end && *compiler->current == ',') {
+            compiler->current++;
+            if (!parseCount(compiler, max)) *max = -1;
+        }
+        if (compiler->current < compiler->end && *compiler->current == '}') {
+            compiler->current++;
+            return true;
+        }
+    }
+    compiler->current = start;
+    return false;
+}
+
+static int parseRepeat(RegexCompiler* compiler) {
+    int atom = parseAtom(compiler);
+    if (atom < 0 || compiler->current >= compiler->end) return atom;
+
+    int min;
+    int max;
+    switch (*compiler->current) {
+        case '*': min = 0; max = -1; break;
+        case '+': min = 1; max = -1; break;
+        case '?': min = 0; max = 1; break;
+        case '{':
+            compiler->current++;
+            if (parseBraces(compiler, &min, &max)) {
+                if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) return fail(compiler, "repeat count too big");
+                if (max >= 0 && max < min) return fail(compiler, "repeat counts out of order");
+                compiler->current--; // stands in for the quantifier byte skipped below
+                break;
+            }
+            compiler->current--;
+            return atom;
+        default:
+            return atom;
+    }
+    compiler->current++;
+
+    NodeType type = compiler->nodes[atom].type;
+    if (type == NODE_BOL || type == NODE_EOL || type == NODE_WORD_BOUNDARY || type == NODE_NOT_WORD_BOUNDARY) {
+        return fail(compiler, "nothing to repeat");
+    }
+
+    int node = addNode(compiler, NODE_REPEAT, 0);
+    compiler->nodes[node].child = atom;
+    compiler->nodes[node].min = min;
+    compiler->nodes[node].max = max;
+    if (compiler->current < compiler->end && *compiler->current == '?') {
+        compiler->nodes[node].greedy = false;
+        compiler->current++;
+    }
+
+    if (compiler->current < compiler->end &&
+        (*compiler->current == '*' || *compiler->current == '+' || *compiler->current == '?')) {
+        return fail(compiler, "nothing to repeat");
+    }
+    if (compiler->current < compiler->end && *compiler->current == '{') {
+        compiler->current++;
+        if (parseBraces(compiler, &min, &max)) return fail(compiler, "nothing to repeat");
+        compiler->current--;
+    }
+    return node;
+}
+
+static int parseConcatenation(RegexCompiler* compiler) {
+    int node = addNode(compiler, NODE_CONCAT, 0);
+    int last = -1;
+    while (compiler->current < compiler->end && *compiler->current != '|' && *compiler->current != ')') {
+        int item = parseRepeat(compiler);
+        if (item < 0) return -1;
+        if (last < 0) {
+            compiler->nodes[node].child = item;
+        } else {
+            compiler->nodes[last].next = item;
+        }
+        last = item;
+    }
+    return node;
+}
+
+static int parseAlternation(RegexCompiler* compiler) {
+    int first = parseConcatenation(compiler);
+    if (first < 0 || compiler->current >= compiler->end || *compiler->current != '|') return first;
+
+    int node = addNode(compiler, NODE_ALTERNATE, 0);
+    compiler->nodes[node].child = first;
+    int last = first;
+    while (compiler->current < compiler->end && *compiler->current == '|') {
+        compiler->current++;
+        int item = parseConcatenation(compiler);
+        if (item < 0) return -1;
+        compiler->nodes[last].next = item;
+        last = item;
+    }
+    return node;
+}
+
+// =============== code generation ===============
+
+static int emit(RegexCompiler* compiler, RegexOp op, int x, int y) {
+    RegexProgram* program = compiler->program;
+    if (program->count >= REGEX_MAX_INSTRUCTIONS) return fail(compiler, "pattern too big");
+
+    program->code = growArray(program->code, &compiler->codeCapacity, program->count, sizeof(RegexInst));
+
+    RegexInst* inst = &program->code[program->count];
+    inst->op = (uint8_t)op;
+    inst->x = x;
+    inst->y = y;
+    return program->count++;
+}
+
+static bool emitNode(RegexCompiler* compiler, int index);
+
+static bool emitRepeat(RegexCompiler* compiler, Node* node) {
+    RegexProgram* program = compiler->program;
+    int copies = node->max < 0 && node->min > 0 ? node->min - 1 : node->min;
+    for (int i = 0; i < copies; i++) {
+        if (!emitNode(compiler, node->child)) return false;
+    }
+
+    if (node->max < 0) {
+        // x* is a split into the body or out, and a loop back to the split. x+ is the same loop
+        // entered at the body
+        int entry = -1;
+        if (node->min > 0 && (entry = emit(compiler, RX_JUMP, 0, 0)) < 0) return false;
+        int split = emit(compiler, RX_SPLIT, 0, 0);
+        if (split < 0) return false;
+        if (!emitNode(compiler, node->child)) return false;
+        int loop = emit(compiler, RX_LOOP, split, 0);
+        if (loop < 0) return false;
+
+        int exit = program->count;
+        if (entry >= 0) program->code[entry].x = split + 1;
+        program->code[loop].y = exit;
+        program->code[split].x = node->greedy ? split + 1 : exit;
+        program->code[split].y = node->greedy ? exit : split + 1;
+        return true;
+    }
+
+    // each optional copy can skip straight past all of the rest, the splits are chained through y
+    // until the end is known
+    int splits = -1;
+    for (int i = node->min; i < node->max; i++) {
+        int split = emit(compiler, RX_SPLIT, 0, splits);
+        if (split < 0) return false;
+        splits = split;
+        if (!emitNode(compiler, node->child)) return false;
+    }
+    while (splits >= 0) {
+        RegexInst* split = &program->code[splits];
+        int previous = split->y;
+        split->x = node->greedy ? splits + 1 : program->count;
+        split->y = node->greedy ? program->count : splits + 1;
+        splits = previous;
+    }
+    return true;
+}
+
+static bool emitNode(RegexCompiler* compiler, int index) {
+    RegexProgram* program = compiler->program;
+    Node* node = &compiler->nodes[index];
+    switch (node->type) {
+        case NODE_CHAR:
+            return emit(compiler, RX_CHAR, node->value, 0) >= 0;
+        case NODE_ANY:
+            return emit(compiler, RX_ANY, 0, 0) >= 0;
+        case NODE_CLASS:
+            return emit(compiler, RX_CLASS, node->value, 0) >= 0;
+        case NODE_BOL:
+            return emit(compiler, RX_BOL, 0, 0) >= 0;
+        case NODE_EOL:
+            return emit(compiler, RX_EOL, 0, 0) >= 0;
+        case NODE_WORD_BOUNDARY:
+            return emit(compiler, RX_WORD_BOUNDARY, 0, 0) >= 0;
+        case NODE_NOT_WORD_BOUNDARY:
+            return emit(compiler, RX_NOT_WORD_BOUNDARY, 0, 0) >= 0;
+        case NODE_CONCAT:
+            for (int child = node->child; child >= 0; child = compiler->nodes[child].next) {
+                if (!emitNode(compiler, child)) return false;
+            }
+            return true;
+        case NODE_ALTERNATE: {
+            // every alternative but the last jumps to the end, the jumps are chained through x
+            // until it's known
+            int jumps = -1;
+            for (int child = node->child; child >= 0; child = compiler->nodes[child].next) {
+                bool last = compiler->nodes[child].next < 0;
+                int split = -1;
+                if (!last && (split = emit(compiler, RX_SPLIT, 0, 0)) < 0) return false;
+                if (!last) program->code[split].x = split + 1;
+                if (!emitNode(compiler, child)) return false;
+                if (last) break;
+
+                int jump = emit(compiler, RX_JUMP, jumps, 0);
+                if (jump < 0) return false;
+                jumps = jump;
+                program->code[split].y = program->count;
+            }
+            while (jumps >= 0) {
+                int previous = program->code[jumps].x;
+                program->code[jumps].x = program->count;
+                jumps = previous;
+            }
+            return true;
+        }
+        case NODE_GROUP:
+            if (emit(compiler, RX_SAVE, node->value * 2, 0) < 0) return false;
+            if (!emitNode(compiler, node->child)) return false;
+            return emit(compiler, RX_SAVE, node->value * 2 + 1, 0) >= 0;
+        case NODE_REPEAT:
+            return emitRepeat(compiler, node);
+    }
+    return false;
+}
+
+// follows every path from pc that doesn't consume a byte, collecting the bytes that could come next.
+// paths through ^ are only live at the start of the subject, so they're noted and left out
+static void scanFirstBytes(RegexProgram* program, int pc, bool* seen) {
+    if (seen[pc]) return;
+    seen[pc] = true;
+
+    RegexInst* inst = &program->code[pc];
+    switch (inst->op) {
+        case RX_CHAR:
+            addByte(&program->firstBytes, inst->x);
+            break;
+        case RX_ANY:
+            for (int byte = 0; byte < 256; byte++) {
+                if (byte != '\n') addByte(&program->firstBytes, byte);
+            }
+            break;
+        case RX_CLASS:
+            for (int i = 0; i < 32; i++) program->firstBytes.bits[i] |= program->classes[inst->x].bits[i];
+            break;
+        case RX_SPLIT:
+            scanFirstBytes(program, inst->x, seen);
+            scanFirstBytes(program, inst->y, seen);
+            break;
+        case RX_JUMP:
+        case RX_LOOP:
+            scanFirstBytes(program, inst->x, seen);
+            break;
+        case RX_BOL:
+            program->hasBolPath = true;
+            break;
+        case RX_EOL:
+        case RX_MATCH:
+            program->canSkip = false;
+            break;
+        default:
+            // saves and word boundaries, which can only narrow what follows them
+            scanFirstBytes(program, pc + 1, seen);
+            break;
+    }
+}
+
+static void analyzeStart(RegexProgram* program) {
+    bool* seen = calloc(program->count, sizeof(bool));
+    if (seen == NULL) compilerOutOfMemory(sizeof(bool) * program->count);
+    program->canSkip = true;
+    scanFirstBytes(program, 0, seen);
+    free(seen);
+
+    int byteCount = 0;
+    program->firstByte = -1;
+    for (int byte = 0; byte < 256; byte++) {
+        if (!hasByte(&program->firstBytes, byte)) continue;
+        byteCount++;
+        program->firstByte = byte;
+    }
+    if (byteCount != 1) program->firstByte = -1;
+    program->anchored = program->canSkip && byteCount == 0;
+
+    // a pattern that starts with literal bytes starts with straight-line code, nothing jumps into it
+    program->prefixLength = 0;
+    for (int pc = 0; pc < program->count && program->prefixLength < REGEX_MAX_PREFIX; pc++) {
+        RegexInst* inst = &program->code[pc];
+        if (inst->op == RX_CHAR) {
+            program->prefix[program->prefixLength++] = (char)inst->x;
+        } else if (inst->op != RX_SAVE) {
+            break;
+        }
+    }
+}
+
+void freeRegexProgram(struct RegexProgram* program) {
+    if (program == NULL) return; // a regex whose pattern hadn't been compiled yet
+    free(program->code);
+    free(program->classes);
+    free(program->visited);
+    free(program->threadPcs[0]);
+    free(program->threadPcs[1]);
+    free(program->threadSlots[0]);
+    free(program->threadSlots[1]);
+    free(program->startSlots);
+    free(program);
+}
+
+// returns NULL and sets *error if the pattern is malformed
+static RegexProgram* compileRegex(ObjString* pattern, const char** error) {
+    RegexProgram* program = calloc(1, sizeof(RegexProgram));
+    if (program == NULL) outOfMemory(sizeof(RegexProgram));
+
+    RegexCompiler compiler;
+    compiler.current = pattern->chars;
+    compiler.end = pattern->chars + pattern->length;
+    compiler.error = NULL;
+    compiler.depth = 0;
+    compiler.nodes = NULL;
+    compiler.nodeCount = 0;
+    compiler.nodeCapacity = 0;
+    compiler.classCapacity = 0;
+    compiler.codeCapacity = 0;
+    compiler.groupCount = 0;
+    compiler.program = program;
+    compiling = &compiler;
+
+    int root = parseAlternation(&compiler);
+    if (root >= 0 && compiler.current < compiler.end) fail(&compiler, "unmatched )");
+    if (compiler.error == NULL) {
+        // the whole match is saved like a group
+        emit(&compiler, RX_SAVE, 0, 0);
+        emitNode(&compiler, root);
+        emit(&compiler, RX_SAVE, 1, 0);
+        emit(&compiler, RX_MATCH, 0, 0);
+    }
+    free(compiler.nodes);
+    compiler.nodes = NULL;
+    if (compiler.error != NULL) {
+        compiling = NULL;
+        *error = compiler.error;
+        freeRegexProgram(program);
+        return NULL;
+    }
+
+    program->slotCount = (compiler.groupCount + 1) * 2;
+    analyzeStart(program);
+
+    int count = program->count;
+    program->visited = calloc(count, sizeof(int));
+    program->threadPcs[0] = malloc(sizeof(int) * count);
+    program->threadPcs[1] = malloc(sizeof(int) * count);
+    program->threadSlots[0] = malloc(sizeof(int) * count * program->slotCount);
+    program->threadSlots[1] = malloc(sizeof(int) * count * program->slotCount);
+    program->startSlots = malloc(sizeof(int) * program->slotCount);
+    if (program->visited == NULL || program->threadPcs[0] == NULL || program->threadPcs[1] == NULL ||
+        program->threadSlots[0] == NULL || program->threadSlots[1] == NULL || program->startSlots == NULL) {
+        compilerOutOfMemory(sizeof(int) * (count * 3 + (count * 2 + 1) * program->slotCount));
+    }
+    compiling = NULL;
+    return program;
+}
+
+// =============== matcher ===============
+
+typedef struct {
+    int* pcs;
+    int* slots; // slotCount for each thread
+    int count;
+} ThreadList;
+
+typedef struct {
+    RegexProgram* program;
+    const char* subject;
+    int length;
+    int position; // where threads being added are
+    int slotCount; // slots to track, 0 when only whether there's a match matters
+} Matcher;
+
+static bool atWordBoundary(Matcher* matcher) {
+    bool before = matcher->position > 0 && isWordByte((uint8_t)matcher->subject[matcher->position - 1]);
+    bool after = matcher->position < matcher->length && isWordByte((uint8_t)matcher->subject[matcher->position]);
+    return before != after;
+}
+
+// adds the thread at pc to list in priority order, following jumps, splits and assertions right away
+// so the list only holds threads waiting on a byte or a match
+static void addThread(Matcher* matcher, ThreadList* list, int pc, int* slots) {
+    RegexProgram* program = matcher->program;
+    RegexInst* inst = &program->code[pc];
+    if (inst->op == RX_LOOP) {
+        // back at the loop's split without moving means this iteration matched nothing. like a
+        // backtracking matcher, keep it and leave the loop rather than dropping the thread. loops
+        // aren't marked visited, since a thread that has moved arrives first and goes round again
+        addThread(matcher, list, program->visited[inst->x] == program->generation ? inst->y : inst->x, slots);
+        return;
+    }
+    if (program->visited[pc] == program->generation) return;
+    program->visited[pc] = program->generation;
+
+    switch (inst->op) {
+        case RX_JUMP:
+            addThread(matcher, list, inst->x, slots);
+            return;
+        case RX_SPLIT:
+            addThread(matcher, list, inst->x, slots);
+            addThread(matcher, list, inst->y, slots);
+            return;
+        case RX_SAVE:
+            if (inst->x < matcher->slotCount) {
+                // the thread's slots are borrowed and put back, rather than copied for every save
+                int saved = slots[inst->x];
+                slots[inst->x] = matcher->position;
+                addThread(matcher, list, pc + 1, slots);
+                slots[inst->x] = saved;
+            } else {
+                addThread(matcher, list, pc + 1, slots);
+            }
+            return;
+        case RX_BOL:
+            if (matcher->position == 0) addThread(matcher, list, pc + 1, slots);
+            return;
+        case RX_EOL:
+            if (matcher->position == matcher->length) addThread(matcher, list, pc + 1, slots);
+            return;
+        case RX_WORD_BOUNDARY:
+            if (atWordBoundary(matcher)) addThread(matcher, list, pc + 1, slots);
+            return;
+        case RX_NOT_WORD_BOUNDARY:
+            if (!atWordBoundary(matcher)) addThread(matcher, list, pc + 1, slots);
+            return;
+        default:
+            list->pcs[list->count] = pc;
+            memcpy(list->slots + list->count * matcher->slotCount, slots, sizeof(int) * matcher->slotCount);
+            list->count++;
+            return;
+    }
+}
+
+// the next position at or after position that could start a match, or -1 if there isn't one
+static int skipAhead(RegexProgram* program, const char* subject, int length, int position) {
+    if (program->prefixLength > 1) {
+        const char* found = memmem(subject + position, length - position, program->prefix, program->prefixLength);
+        return found == NULL ? -1 : (int)(found - subject);
+    }
+    if (program->firstByte >= 0) {
+        const char* found = memchr(subject + position, program->firstByte, length - position);
+        return found == NULL ? -1 : (int)(found - subject);
+    }
+    while (position < length && !hasByte(&program->firstBytes, (uint8_t)subject[position])) position++;
+    return position < length ? position : -1;
+}
+
+// finds the leftmost-first match in subject at or after start. slots gets the program's slotCount
+// offsets, -1 for groups that took no part, unless it's NULL
+static bool runRegex(RegexProgram* program, const char* subject, int length, int start, int* slots) {
+    Matcher matcher;
+    matcher.program = program;
+    matcher.subject = subject;
+    matcher.length = length;
+    matcher.slotCount = slots != NULL ? program->slotCount : 0;
+
+    ThreadList current = {program->threadPcs[0], program->threadSlots[0], 0};
+    ThreadList next = {program->threadPcs[1], program->threadSlots[1], 0};
+    bool matched = false;
+
+    for (int position = start; ; position++) {
+        if (!matched) {
+            if (current.count == 0) {
+                // ^ can only match at 0 and nothing else could start an empty match
+                if (program->anchored && position > 0) break;
+                if (program->canSkip && (position > 0 || !program->hasBolPath)) {
+                    position = skipAhead(program, subject, length, position);
+                    if (position < 0) break;
+                }
+                // visited marks are only good for the position they were made at
+                program->generation++;
+            }
+
+            // a match starting here has lower priority than every thread that started earlier
+            matcher.position = position;
+            for (int i = 0; i < matcher.slotCount; i++) program->startSlots[i] = -1;
+            addThread(&matcher, &current, 0, program->startSlots);
+        }
+        if (current.count == 0) {
+            if (matched || position >= length) break;
+            continue;
+        }
+
+        program->generation++;
+        next.count = 0;
+        matcher.position = position + 1;
+        int byte = position < length ? (uint8_t)subject[position] : -1;
+
+        for (int i = 0; i < current.count; i++) {
+            RegexInst* inst = &program->code[current.pcs[i]];
+            int* threadSlots = current.slots + i * matcher.slotCount;
+            bool advances = false;
+            switch (inst->op) {
+                case RX_CHAR:
+                    advances = byte == inst->x;
+                    break;
+                case RX_ANY:
+                    advances = byte >= 0 && byte != '\n';
+                    break;
+                case RX_CLASS:
+                    advances = byte >= 0 && hasByte(&program->classes[inst->x], byte);
+                    break;
+                case RX_MATCH:
+                    matched = true;
+                    if (slots == NULL) return true;
+                    memcpy(slots, threadSlots, sizeof(int) * matcher.slotCount);
+                    // every later thread has lower priority, so cut them off
+                    i = current.count;
+                    break;
+            }
+            if (advances) addThread(&matcher, &next, current.pcs[i] + 1, threadSlots);
+        }
+
+        ThreadList swap = current;
+        current = next;
+        next = swap;
+        if (position >= length) break;
+    }
+    return matched;
+}
+
+// =============== natives ===============
+
+// a regex() object, or a pattern string compiled the first time it's seen.
+// returns NULL after reporting the error
+static ObjRegex* toRegex(Value value, const char* name) {
+    if (IS_REGEX(value)) return AS_REGEX(value);
+    if (!IS_STRING(value)) {
+        runtimeError("First argument to %s() must be a regex or a pattern string.", name);
+        return NULL;
+    }
+
+    ObjString* pattern = AS_STRING(value);
+    ObjString* key = findInterned(pattern);
+    Value cached;
+    if (key != NULL && tableGet(&vm.regexes, key, &cached)) return AS_REGEX(cached);
+
+    // the object comes first so the program is never left unowned if allocating it fails
+    ObjRegex* regex = newRegex(pattern, NULL);
+    push(OBJ_VAL(regex));
+    const char* error;
+    regex->program = compileRegex(pattern, &error);
+    if (regex->program == NULL) {
+        runtimeError("Invalid regex /%s/: %s.", pattern->chars, error);
+        return NULL;
+    }
+
+    key = intern(pattern);
+    push(OBJ_VAL(key));
+    tableSet(&vm.regexes, key, OBJ_VAL(regex));
+    pop();
+    pop();
+    return regex;
+}
+
+// reads the subject and the optional start offset for the regex natives
+static bool matchArguments(int argCount, Value* args, const char* name, ObjRegex** regex, ObjString** subject,
+                           int* start) {
+    if (argCount < 2 || argCount > 3) {
+        runtimeError("%s() takes a regex, a subject string and an optional start offset.", name);
+        return false;
+    }
+    if ((*regex = toRegex(args[0], name)) == NULL) return false;
+    if (!IS_STRING(args[1])) {
+        runtimeError("Second argument to %s() must be a string.", name);
+        return false;
+    }
+    *subject = AS_STRING(args[1]);
+
+    *start = 0;
+    if (argCount == 3) {
+        double from = IS_NUMBER(args[2]) ? AS_NUMBER(args[2]) : -1;
+        if (!(from >= 0 && from <= (*subject)->length) || from != (int)from) {
+            runtimeError("Start offset for %s() must be a whole number within the subject.", name);
+            return false;
+        }
+        *start = (int)from;
+    }
+    return true;
+}
+
+// regex(pattern) compiles pattern, or reports what's wrong with it
+static bool regexNative(int argCount, Value* args) {
+    ObjRegex* regex = toRegex(args[0], "regex");
+    if (regex == NULL) return false;
+    args[-1] = OBJ_VAL(regex);
+    return true;
+}
+
+// regexTest(regex, subject[, start]) returns whether there's a match
+static bool regexTestNative(int argCount, Value* args) {
+    ObjRegex* regex;
+    ObjString* subject;
+    int start;
+    if (!matchArguments(argCount, args, "regexTest", &regex, &subject, &start)) return false;
+
+    args[-1] = BOOL_VAL(runRegex(regex->program, subject->chars, subject->length, start, NULL));
+    return true;
+}
+
+// regexFind(regex, subject[, start]) returns the match as offsets into subject,
+// [start, end, group 1 start, group 1 end, ...] with nil for groups that took no part, or nil if
+// there's no match. substring() cuts them out, nothing is copied until then
+static bool regexFindNative(int argCount, Value* args) {
+    ObjRegex* regex;
+    ObjString* subject;
+    int start;
+    if (!matchArguments(argCount, args, "regexFind", &regex, &subject, &start)) return false;
+
+    int slots[(REGEX_MAX_GROUPS + 1) * 2];
+    if (!runRegex(regex->program, subject->chars, subject->length, start, slots)) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+
+    ObjArray* result = newArray();
+    args[-1] = OBJ_VAL(result);
+    for (int i = 0; i < regex->program->slotCount; i++) {
+        writeValueArray(&result->items, slots[i] < 0 ? NIL_VAL : INT_VAL(slots[i]));
+    }
+    return true;
+}
+
+// regexMatch(regex, subject[, start]) returns the matched text and each group's as strings,
+// nil for groups that took no part, or nil if there's no match
+static bool regexMatchNative(int argCount, Value* args) {
+    ObjRegex* regex;
+    ObjString* subject;
+    int start;
+    if (!matchArguments(argCount, args, "regexMatch", &regex, &subject, &start)) return false;
+
+    int slots[(REGEX_MAX_GROUPS + 1) * 2];
+    if (!runRegex(regex->program, subject->chars, subject->length, start, slots)) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+
+    ObjArray* result = newArray();
+    args[-1] = OBJ_VAL(result);
+    for (int i = 0; i < regex->program->slotCount; i += 2) {
+        Value group = NIL_VAL;
+        if (slots[i] >= 0 && slots[i + 1] >= 0) {
+            group = OBJ_VAL(copyString(subject->chars + slots[i], slots[i + 1] - slots[i]));
+        }
+        push(group);
+        writeValueArray(&result->items, group);
+        pop();
+    }
+    return true;
+}
+
+void defineRegexNatives() {
+    defineNative("regex", regexNative, 1);
+    defineNative("regexTest", regexTestNative, -1);
+    defineNative("regexFind", regexFindNative, -1);
+    defineNative("regexMatch", regexMatchNative, -1);
+}
@@ -0,0 +1,9 @@
+#ifndef clox_regex_h
+#define clox_regex_h
+
+struct RegexProgram;
+
+void freeRegexProgram(struct RegexProgram* program);
+void defineRegexNatives();
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "sort.h"
+#include "vm.h"
+
+// sort(array) and sort(array, comparator) sort an array in place and return it.
+// all-number arrays are radix sorted on their bit patterns, all-string arrays are merge sorted
+// with memcmp, anything else needs a comparator, which is called through callFromNative()
+
+// below this a comparison sort beats the radix sort's fixed passes over the histograms
+#define RADIX_SORT_THRESHOLD 64
+// runs this short are insertion sorted before merging
+#define INSERTION_SORT_THRESHOLD 12
+
+typedef struct Sorter Sorter;
+// sets *less to whether a sorts before b, returns false if a Lox comparator raised an error
+typedef bool (*LessFn)(Sorter* sorter, Value a, Value b, bool* less);
+
+struct Sorter {
+    LessFn lessThan;
+    Value comparator;
+};
+
+// =============== comparators ===============
+
+static bool numberLess(Sorter* sorter, Value a, Value b, bool* less) {
+    *less = AS_NUMBER(a) < AS_NUMBER(b);
+    return true;
+}
+
+static bool stringLess(Sorter* sorter, Value a, Value b, bool* less) {
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    int length = left->length < right->length ? left->length : right->length;
+    int order = memcmp(left->chars, right->chars, length);
+    *less = order < 0 || (order == 0 && left->length < right->length);
+    return true;
+}
+
+// the comparator returns true or a negative number when a sorts before b
+static bool closureLess(Sorter* sorter, Value a, Value b, bool* less) {
+    push(sorter->comparator);
+    push(a);
+    push(b);
+    if (!callFromNative(2)) return false;
+
+    Value result = pop();
+    if (IS_BOOL(result)) {
+        *less = AS_BOOL(result);
+    } else if (IS_NUMBER(result)) {
+        *less = AS_NUMBER(result) < 0;
+    } else {
+        runtimeError("Sort comparator must return a boolean or a number.");
+        return false;
+    }
+    return true;
+}
+
+// =============== merge sort ===============
+
+// stable and never reads out of bounds however inconsistent the comparator is
+static bool insertionSort(Sorter* sorter, Value* items, int count) {
+    for (int i = 1; i < count; i++) {
+        Value item = items[i];
+        int j = i;
+        while (j > 0) {
+            bool less;
+            if (!sorter->lessThan(sorter, item, items[j - 1], &less)) return false;
+            if (!less) break;
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+    return true;
+}
+
+// sorts items using scratch, which has room for count values
+static bool mergeSort(Sorter* sorter, Value* items, Value* scratch, int count) {
+    if (count <= INSERTION_SORT_THRESHOLD) return insertionSort(sorter, items, count);
+
+    int middle = count / 2;
+    if (!mergeSort(sorter, items, scratch, middle)) return false;
+    if (!mergeSort(sorter, items + middle, scratch, count - middle)) return false;
+
+    // already in order, which makes sorted and nearly sorted input cheap
+    bool less;
+    if (!sorter->lessThan(sorter, items[middle], items[middle - 1], &less)) return false;
+    if (!less) return true;
+
+    memcpy(scratch, items, sizeof(Value) * middle);
+    int left = 0;
+    int right = middle;
+    int out = 0;
+    while (left < middle && right < count) {
+        if (!sorter->lessThan(sorter, items[right], scratch[left], &less)) return false;
+        items[out++] = less ? items[right++] : scratch[left++];
+    }
+    while (left < middle) items[out++] = scratch[left++];
+    return true;
+}
+
+// =============== radix sort ===============
+
+// maps a double to an unsigned key with the same order: flip every bit of negatives, the sign bit of positives
+static inline uint64_t numberKey(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return (bits & (1ull << 63)) ? ~bits : bits ^ (1ull << 63);
+}
+
+static inline Value keyValue(uint64_t key) {
+    uint64_t bits = (key & (1ull << 63)) ? key ^ (1ull << 63) : ~key;
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+
+    // integral numbers go back to the integer representation the compiler would give them
+    return numberValue(number);
+}
+
+// least significant byte first, skipping bytes that are the same in every key, which for
+// small integers is most of them
+static void radixSort(Value* items, int count) {
+    // not Lox values, so not managed by the GC
+    uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * count * 2);
+    if (keys == NULL) outOfMemory(sizeof(uint64_t) * count * 2);
+    uint64_t* scratch = keys + count;
+
+    int counts[8][256] = {{0}};
+    for (int i = 0; i < count; i++) {
+        uint64_t key = numberKey(AS_NUMBER(items[i]));
+        keys[i] = key;
+        for (int byte = 0; byte < 8; byte++) counts[byte][(key >> (byte * 8)) & 0xff]++;
+    }
+
+    for (int byte = 0; byte < 8; byte++) {
+        int* histogram = counts[byte];
+        if (histogram[(keys[0] >> (byte * 8)) & 0xff] == count) continue;
+
+        int offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            int digitCount = histogram[digit];
+            histogram[digit] = offset;
+            offset += digitCount;
+        }
+        for (int i = 0; i < count; i++) {
+            uint64_t key = keys[i];
+            scratch[histogram[(key >> (byte * 8)) & 0xff]++] = key;
+        }
+
+        uint64_t* swap = keys;
+        keys = scratch;
+        scratch = swap;
+    }
+
+    for (int i = 0; i < count; i++) items[i] = keyValue(keys[i]);
+    free(keys < scratch ? keys : scratch);
+}
+
+// =============== native ===============
+
+static bool sortNative(int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2) {
+        runtimeError("sort() takes an array and an optional comparator.");
+        return false;
+    }
+    if (!IS_ARRAY(args[0])) {
+        runtimeError("First argument to sort() must be an array.");
+        return false;
+    }
+    if (argCount == 2 && !IS_CLOSURE(args[1]) && !IS_NATIVE(args[1])) {
+        runtimeError("Second argument to sort() must be a function.");
+        return false;
+    }
+
+    ObjArray* array = AS_ARRAY(args[0]);
+    int count = array->items.count;
+    args[-1] = args[0];
+    if (count < 2) return true;
+
+    Sorter sorter;
+    if (argCount == 2) {
+        sorter.lessThan = closureLess;
+        sorter.comparator = args[1];
+    } else {
+        bool numbers = true;
+        bool strings = true;
+        for (int i = 0; i < count && (numbers || strings); i++) {
+            numbers = numbers && IS_NUMBER(array->items.values[i]);
+            strings = strings && IS_STRING(array->items.values[i]);
+        }
+
+        if (numbers && count >= RADIX_SORT_THRESHOLD) {
+            radixSort(array->items.values, count);
+            return true;
+        }
+        if (!numbers && !strings) {
+            runtimeError("sort() needs a comparator unless the array is all numbers or all strings.");
+            return false;
+        }
+        sorter.lessThan = numbers ? numberLess : stringLess;
+    }
+
+    if (sorter.lessThan != closureLess) {
+        // nothing here can allocate, so the array can be sorted where it is
+        Value* scratch = (Value*)malloc(sizeof(Value) * (count / 2 + 1));
+        if (scratch == NULL) outOfMemory(sizeof(Value) * (count / 2 + 1));
+        mergeSort(&sorter, array->items.values, scratch, count);
+        free(scratch);
+        return true;
+    }
+
+    // the comparator can run the GC or change the array, so sort a copy that the stack keeps alive
+    // and only write it back if the array is still the same size
+    ObjArray* copy = newArray();
+    push(OBJ_VAL(copy));
+    for (int i = 0; i < count + count / 2 + 1; i++) {
+        writeValueArray(&copy->items, i < count ? array->items.values[i] : NIL_VAL);
+    }
+
+    // a failed comparator has already reset the stack, so there's no copy left to pop
+    if (!mergeSort(&sorter, copy->items.values, copy->items.values + count, count)) return false;
+    pop();
+
+    if (array->items.count != count) {
+        runtimeError("Array changed size while it was being sorted.");
+        return false;
+    }
+    memcpy(array->items.values, copy->items.values, sizeof(Value) * count);
+    return true;
+}
+
+void defineSortNatives() {
+    defineNative("sort", sortNative, -1);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_sort_h
+#define clox_sort_h
+
+void defineSortNatives();
+
+#endif
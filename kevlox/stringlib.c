@@ -0,0 +1,209 @@
+#define _GNU_SOURCE // for memmem()
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "stringlib.h"
+#include "vm.h"
+
+// string searching and slicing. searches go through libc's memchr() for single bytes and memmem()
+// for longer needles, which are vectorized and two-way respectively, and results are built
+// straight from the subject's bytes so the only strings allocated are the ones returned. like other
+// strings made at runtime they aren't interned unless they're used as a key
+
+// the first occurrence of needle in haystack, or NULL
+static const char* findBytes(const char* haystack, int length, const char* needle, int needleLength) {
+    if (needleLength == 1) return memchr(haystack, needle[0], length);
+    return memmem(haystack, length, needle, needleLength);
+}
+
+static bool stringArguments(int argCount, Value* args, const char* name) {
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_STRING(args[i])) {
+            runtimeError("Arguments to %s() must be strings.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// checks that offset is a whole number from 0 to length
+static bool offsetArgument(Value offset, int length, const char* name, int* result) {
+    double number = IS_NUMBER(offset) ? AS_NUMBER(offset) : -1;
+    if (!(number >= 0 && number <= length) || number != (int)number) { // NaN included
+        runtimeError("Offset for %s() must be a whole number within the string.", name);
+        return false;
+    }
+    *result = (int)number;
+    return true;
+}
+
+// substring(string, start, end) copies out the bytes from start up to end, like the offsets regexFind() returns
+static bool substringNative(int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        runtimeError("First argument to substring() must be a string.");
+        return false;
+    }
+
+    ObjString* string = AS_STRING(args[0]);
+    int start;
+    int end;
+    if (!offsetArgument(args[1], string->length, "substring", &start)) return false;
+    if (!offsetArgument(args[2], string->length, "substring", &end)) return false;
+    if (end < start) {
+        runtimeError("substring() end comes before its start.");
+        return false;
+    }
+
+    args[-1] = OBJ_VAL(copyString(string->chars + start, end - start));
+    return true;
+}
+
+// indexOf(string, needle[, from]) is the offset of the first needle at or after from, or -1
+static bool indexOfNative(int argCount, Value* args) {
+    if (argCount < 2 || argCount > 3) {
+        runtimeError("indexOf() takes a string, a needle and an optional start offset.");
+        return false;
+    }
+    if (!stringArguments(2, args, "indexOf")) return false;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* needle = AS_STRING(args[1]);
+    int from = 0;
+    if (argCount == 3 && !offsetArgument(args[2], string->length, "indexOf", &from)) return false;
+
+    if (needle->length == 0) {
+        args[-1] = INT_VAL(from);
+        return true;
+    }
+    const char* found = findBytes(string->chars + from, string->length - from, needle->chars, needle->length);
+    args[-1] = INT_VAL(found == NULL ? -1 : (int)(found - string->chars));
+    return true;
+}
+
+// contains(string, needle) is whether needle is anywhere in string
+static bool containsNative(int argCount, Value* args) {
+    if (!stringArguments(2, args, "contains")) return false;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* needle = AS_STRING(args[1]);
+    args[-1] = BOOL_VAL(needle->length == 0 ||
+                        findBytes(string->chars, string->length, needle->chars, needle->length) != NULL);
+    return true;
+}
+
+// count(string, needle) is how many times needle occurs without overlapping, an empty needle
+// occurs between every byte and at both ends
+static bool countNative(int argCount, Value* args) {
+    if (!stringArguments(2, args, "count")) return false;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* needle = AS_STRING(args[1]);
+    if (needle->length == 0) {
+        args[-1] = INT_VAL(string->length + 1);
+        return true;
+    }
+
+    int count = 0;
+    const char* current = string->chars;
+    const char* end = string->chars + string->length;
+    const char* found;
+    while ((found = findBytes(current, (int)(end - current), needle->chars, needle->length)) != NULL) {
+        count++;
+        current = found + needle->length;
+    }
+    args[-1] = INT_VAL(count);
+    return true;
+}
+
+// adds a new string to an array that's already reachable, keeping the string reachable while the array grows
+static void pushString(ObjArray* array, const char* chars, int length) {
+    push(OBJ_VAL(copyString(chars, length)));
+    writeValueArray(&array->items, vm.stackTop[-1]);
+    pop();
+}
+
+// split(string, separator) returns the pieces between separators, or each byte if separator is empty
+static bool splitNative(int argCount, Value* args) {
+    if (!stringArguments(2, args, "split")) return false;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* separator = AS_STRING(args[1]);
+    ObjArray* pieces = newArray();
+    args[-1] = OBJ_VAL(pieces);
+
+    if (separator->length == 0) {
+        for (int i = 0; i < string->length; i++) pushString(pieces, string->chars + i, 1);
+        return true;
+    }
+
+    const char* current = string->chars;
+    const char* end = string->chars + string->length;
+    const char* found;
+    while ((found = findBytes(current, (int)(end - current), separator->chars, separator->length)) != NULL) {
+        pushString(pieces, current, (int)(found - current));
+        current = found + separator->length;
+    }
+    pushString(pieces, current, (int)(end - current));
+    return true;
+}
+
+// replace(string, old, new) replaces every occurrence of old, building the result in one buffer
+static bool replaceNative(int argCount, Value* args) {
+    if (!stringArguments(3, args, "replace")) return false;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* old = AS_STRING(args[1]);
+    ObjString* replacement = AS_STRING(args[2]);
+    if (old->length == 0) {
+        runtimeError("replace() needs a non-empty string to replace.");
+        return false;
+    }
+
+    const char* end = string->chars + string->length;
+    const char* found = findBytes(string->chars, string->length, old->chars, old->length);
+    if (found == NULL) {
+        args[-1] = args[0];
+        return true;
+    }
+
+    // count first so the result is allocated once at its final size
+    int64_t count = 0;
+    for (const char* current = found; current != NULL;
+         current = findBytes(current + old->length, (int)(end - current - old->length), old->chars, old->length)) {
+        count++;
+    }
+    int64_t length = string->length + count * (replacement->length - old->length);
+    if (length > INT32_MAX - 1) {
+        runtimeError("replace() result is too long.");
+        return false;
+    }
+
+    char* chars = ALLOCATE(char, length + 1);
+    char* out = chars;
+    const char* current = string->chars;
+    while (found != NULL) {
+        memcpy(out, current, found - current);
+        out += found - current;
+        memcpy(out, replacement->chars, replacement->length);
+        out += replacement->length;
+        current = found + old->length;
+        found = findBytes(current, (int)(end - current), old->chars, old->length);
+    }
+    memcpy(out, current, end - current);
+    chars[length] = '\0';
+
+    args[-1] = OBJ_VAL(takeString(chars, (int)length));
+    return true;
+}
+
+void defineStringNatives() {
+    defineNative("substring", substringNative, 3);
+    defineNative("indexOf", indexOfNative, -1);
+    defineNative("contains", containsNative, 2);
+    defineNative("count", countNative, 2);
+    defineNative("split", splitNative, 2);
+    defineNative("replace", replaceNative, 3);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_stringlib_h
+#define clox_stringlib_h
+
+void defineStringNatives();
+
+#endif
@@ -55,13 +55,14 @@ static void adjustCapacity(Table* table, int capacity) {
     }
 
     // rehash
+    table->count = 0; // tombstones aren't carried over
     for (int i=0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if(entry->key == NULL) continue;
 
         Entry* dest = findEntry(entries, capacity, entry->key);
         dest->key = entry->key;
-        dest->value = entries->value;
+        dest->value = entry->value;
         table->count++;
     }
 
@@ -123,7 +124,7 @@ void tableAddAll(Table* from, Table* to) {
     }
 }
 
-// deduplicate strings and then the rest of the VM can take for granted that any two strings at different addresses in memory must have different contents
+// looks a key up by its contents, for interning. keys are interned so other lookups can just compare addresses
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
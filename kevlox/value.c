@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "number.h"
 #include "value.h"
 #include "object.h"
 
@@ -13,9 +14,11 @@ void initValueArray(ValueArray* array) {
 
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
+        // capacity only changes once the grow succeeds, running out of memory leaves the array as it was
         int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(Value, array->values, oldCapacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -28,24 +31,36 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_INT:
+        case VAL_NUMBER: {
+            // shortest text that reads back as the same number, so printing loses nothing
+            char buffer[NUMBER_BUFFER_SIZE];
+            int length = IS_INT(value) ? formatInt(AS_INT(value), buffer) : formatNumber(AS_NUMBER(value), buffer);
+            fwrite(buffer, 1, length, stdout);
+            break;
+        }
         case VAL_OBJ: printObject(value); break;
     }
 }
 
 bool valuesEqual(Value a, Value b) {
-    if (a.type != b.type) return false;
+    // 1 and 1.0 are the same number even when they're stored differently
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) return false;
 
-    switch (a.type) {
+    switch (VALUE_TYPE(a)) {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            // strings made at runtime aren't interned, so equal strings can be different objects
+            return IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b));
         default: 
             return false; // unreachable
     }
@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -9,14 +11,82 @@ typedef struct ObjString ObjString;
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
+    VAL_INT,    // small integer, same numeric semantics as VAL_NUMBER
     VAL_NUMBER,
     VAL_OBJ, // lives on the heap
 } ValueType;
 
+#ifdef POINTER_COMPRESSION
+
+#if UINTPTR_MAX <= 0xffffffff
+#error "POINTER_COMPRESSION is for 64-bit hosts"
+#endif
+
+// every object is in the heap cage, a 4GB reservation made by memory.c, so an object is named by
+// its 32-bit offset from the cage's start. that fits in the payload of a quiet NaN with room for
+// a tag, so a Value is 8 bytes: a double, or a NaN whose bits 32-34 say what the low 32 bits hold
+typedef uint64_t Value;
+
+extern char* heapCage;
+
+#define QNAN              ((uint64_t)0x7ffc000000000000)
+#define TAG_BITS          ((uint64_t)0xffffffff00000000)
+#define TAG_NIL           (QNAN | ((uint64_t)1 << 32))
+#define TAG_FALSE         (QNAN | ((uint64_t)2 << 32))
+#define TAG_TRUE          (QNAN | ((uint64_t)3 << 32))
+#define TAG_INT           (QNAN | ((uint64_t)4 << 32))
+#define TAG_OBJ           (QNAN | ((uint64_t)5 << 32))
+
+#define IS_BOOL(value)    (((value) & ~((uint64_t)1 << 32)) == TAG_FALSE)
+#define IS_NIL(value)     ((value) == TAG_NIL)
+#define IS_INT(value)     (((value) & TAG_BITS) == TAG_INT)
+#define IS_DOUBLE(value)  (((value) & QNAN) != QNAN)
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value)) // either representation
+#define IS_OBJ(value)     (((value) & TAG_BITS) == TAG_OBJ)
+
+#define AS_BOOL(value)    ((value) == TAG_TRUE)
+#define AS_INT(value)     ((int32_t)(uint32_t)(value))
+#define AS_NUMBER(value)  valueToNumber(value) // widening ints to double
+#define AS_OBJ(value)     ((Obj*)(heapCage + (uint32_t)(value)))
+
+#define BOOL_VAL(value)   ((value) ? TAG_TRUE : TAG_FALSE)
+#define NIL_VAL           TAG_NIL
+#define INT_VAL(value)    (TAG_INT | (uint32_t)(int32_t)(value))
+#define NUMBER_VAL(value) numberToValue(value)
+#define OBJ_VAL(object)   (TAG_OBJ | (uint32_t)((char*)(object) - heapCage))
+
+#define VALUE_TYPE(value) valueType(value)
+
+static inline double valueToNumber(Value value) {
+    if (IS_INT(value)) return (double)AS_INT(value);
+    double number;
+    memcpy(&number, &value, sizeof(double));
+    return number;
+}
+
+static inline Value numberToValue(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+static inline ValueType valueType(Value value) {
+    if (IS_DOUBLE(value)) return VAL_NUMBER;
+    switch (value & TAG_BITS) {
+        case TAG_NIL: return VAL_NIL;
+        case TAG_INT: return VAL_INT;
+        case TAG_OBJ: return VAL_OBJ;
+        default: return VAL_BOOL;
+    }
+}
+
+#else
+
 typedef struct {
     ValueType type;
     union {
         bool boolean;
+        int32_t integer;
         double number;
         Obj* obj;
     } as;
@@ -24,11 +94,14 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMBER(value)  ((value).type == VAL_NUMBER || (value).type == VAL_INT) // either representation
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value)    ((value).as.boolean) // checks value as bool
-#define AS_NUMBER(value)  ((value).as.number)  // checks value as number
+#define AS_INT(value)     ((value).as.integer)
+#define AS_NUMBER(value)  valueToNumber(value) // checks value as number, widening ints to double
 #define AS_OBJ(value)     ((value).as.obj)
 
 // creates a Value object of type VAL_BOOL and assigns the value to the boolean member of the union
@@ -37,14 +110,25 @@ typedef struct {
 // creates a Value object of type VAL_NIL. Since VAL_NIL does not require any meaningful data, the .number member is simply initialized to 0
 #define NIL_VAL           ((Value){VAL_NIL,  {.number = 0}})
 
+// creates a Value object of type VAL_INT. every int32 is exactly representable as a double, so this is only a faster encoding of a number
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
+
 // creates a Value object of type VAL_NUMBER and assigns the value to the number member of the union
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 
 // takes a bare Obj pointer and wraps it in a full Value
 #define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#define VALUE_TYPE(value) ((value).type)
+
 // typedef double Value;
 
+static inline double valueToNumber(Value value) {
+    return IS_INT(value) ? (double)value.as.integer : value.as.number;
+}
+
+#endif
+
 // constant pool: dynamic array of Values
 // wraps a pointer to an array along with its allocated capacity and the number of elements in use
 typedef struct {
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "verifier.h"
+#include "vm.h"
+
+// static checks on a function's bytecode so that run() can execute it without checking anything itself:
+// every jump lands on an instruction, every constant/local/upvalue operand is in range,
+// each instruction is always reached with the same stack depth and the stack never gets deeper
+// than the maxStack the function declares, which call() relies on instead of checking each push
+
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+    bool* starts;   // true at each offset where an instruction begins
+    int* depths;    // stack depth on entry to each instruction, -1 if not reached yet
+    int* worklist;  // offsets of branch targets still to be walked
+    int worklistCount;
+} Verifier;
+
+static bool verifyError(Verifier* verifier, int offset, const char* message) {
+    ObjFunction* function = verifier->function;
+    fprintf(stderr, "Invalid bytecode in %s at %04d: %s\n",
+            function->name != NULL ? function->name->chars : "script", offset, message);
+    return false;
+}
+
+// returns the size in bytes of the instruction at offset, or -1 if it's malformed
+static int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return 3;
+        case OP_LOOP_LESS_LOCAL:
+        case OP_LOOP_LESS_CONSTANT:
+            return 5;
+        case OP_CLOSURE: {
+            // the operands depend on the upvalue count of the function being closed over
+            if (offset + 1 >= chunk->count) return -1;
+            uint8_t constant = chunk->code[offset + 1];
+            if (constant >= chunk->constants.count) return -1;
+            if (!isObjType(chunk->constants.values[constant], OBJ_FUNCTION)) return -1;
+            return 2 + AS_FUNCTION(chunk->constants.values[constant])->upvalueCount * 2;
+        }
+        default:
+            return -1;
+    }
+}
+
+// record that a branch reaches target with the given depth, queueing it the first time
+static bool reach(Verifier* verifier, int from, int target, int depth) {
+    if (target < 0 || target >= verifier->chunk->count || !verifier->starts[target]) {
+        return verifyError(verifier, from, "Jump into the middle of an instruction.");
+    }
+
+    if (verifier->depths[target] == -1) {
+        verifier->depths[target] = depth;
+        verifier->worklist[verifier->worklistCount++] = target;
+    } else if (verifier->depths[target] != depth) {
+        return verifyError(verifier, from, "Inconsistent stack depth at jump target.");
+    }
+    return true;
+}
+
+static bool constantInRange(Verifier* verifier, uint8_t index) {
+    return index < verifier->chunk->constants.count;
+}
+
+// walk one instruction, checking its operands against the current depth and queueing its successors
+static bool verifyInstruction(Verifier* verifier, int offset) {
+    Chunk* chunk = verifier->chunk;
+    uint8_t* code = &chunk->code[offset];
+    int depth = verifier->depths[offset];
+    int length = instructionLength(chunk, offset);
+
+    int pops = 0;
+    int pushes = 0;
+    bool fallsThrough = true;
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            if (!constantInRange(verifier, code[1])) return verifyError(verifier, offset, "Constant index out of range.");
+            pushes = 1;
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            pushes = 1;
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            pops = 1;
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            if (code[1] >= depth) return verifyError(verifier, offset, "Local slot out of range.");
+            if (code[0] == OP_GET_LOCAL) {
+                pushes = 1;
+            } else {
+                pops = 1;
+                pushes = 1;
+            }
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            if (!constantInRange(verifier, code[1]) || !IS_STRING(chunk->constants.values[code[1]])) {
+                return verifyError(verifier, offset, "Global name must be a string constant.");
+            }
+            if (code[0] == OP_GET_GLOBAL) {
+                pushes = 1;
+            } else if (code[0] == OP_DEFINE_GLOBAL) {
+                pops = 1;
+            } else {
+                pops = 1;
+                pushes = 1;
+            }
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            if (code[1] >= verifier->function->upvalueCount) return verifyError(verifier, offset, "Upvalue index out of range.");
+            if (code[0] == OP_GET_UPVALUE) {
+                pushes = 1;
+            } else {
+                pops = 1;
+                pushes = 1;
+            }
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP: {
+            int jump = (code[1] << 8) | code[2];
+            int target = code[0] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+            if (code[0] == OP_JUMP_IF_FALSE && depth < 2) return verifyError(verifier, offset, "Stack underflow.");
+            if (!reach(verifier, offset, target, depth)) return false;
+            fallsThrough = code[0] == OP_JUMP_IF_FALSE;
+            break;
+        }
+        case OP_LOOP_LESS_LOCAL:
+        case OP_LOOP_LESS_CONSTANT: {
+            if (code[1] >= depth) return verifyError(verifier, offset, "Local slot out of range.");
+            if (code[0] == OP_LOOP_LESS_LOCAL ? code[2] >= depth : !constantInRange(verifier, code[2])) {
+                return verifyError(verifier, offset, "Loop limit out of range.");
+            }
+            int jump = (code[3] << 8) | code[4];
+            if (!reach(verifier, offset, offset + 5 - jump, depth)) return false;
+            break;
+        }
+        case OP_CALL:
+            pops = code[1] + 1;
+            pushes = 1;
+            break;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                uint8_t isLocal = code[2 + i * 2];
+                uint8_t index = code[3 + i * 2];
+                if (isLocal > 1) return verifyError(verifier, offset, "Malformed upvalue capture.");
+                if (isLocal ? index >= depth : index >= verifier->function->upvalueCount) {
+                    return verifyError(verifier, offset, "Captured variable out of range.");
+                }
+            }
+            pushes = 1;
+            break;
+        }
+        case OP_RETURN:
+            pops = 1;
+            fallsThrough = false;
+            break;
+    }
+
+    // slot 0 holds the function being called and is never an operand
+    if (depth - pops < 1) return verifyError(verifier, offset, "Stack underflow.");
+
+    int next = depth - pops + pushes;
+    if (next > verifier->function->maxStack) return verifyError(verifier, offset, "Stack deeper than the function's declared maximum.");
+
+    if (fallsThrough) {
+        if (offset + length >= chunk->count) return verifyError(verifier, offset, "Execution runs off the end of the chunk.");
+        if (!reach(verifier, offset, offset + length, next)) return false;
+    }
+    return true;
+}
+
+static bool verifyChunk(Verifier* verifier) {
+    Chunk* chunk = verifier->chunk;
+
+    // decode linearly first so jump targets can be checked against instruction boundaries
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        if (length < 0) return verifyError(verifier, offset, "Unknown or malformed instruction.");
+        if (offset + length > chunk->count) return verifyError(verifier, offset, "Truncated instruction.");
+
+        verifier->starts[offset] = true;
+        offset += length;
+    }
+
+    if (chunk->count == 0) return verifyError(verifier, 0, "Empty chunk.");
+
+    // then walk every reachable path; the callee and its arguments are already on the stack
+    int entryDepth = verifier->function->arity + 1;
+    if (entryDepth > verifier->function->maxStack || verifier->function->maxStack > STACK_MAX) {
+        return verifyError(verifier, 0, "Invalid declared stack size.");
+    }
+    if (!reach(verifier, 0, 0, entryDepth)) return false;
+
+    while (verifier->worklistCount > 0) {
+        int offset = verifier->worklist[--verifier->worklistCount];
+        if (!verifyInstruction(verifier, offset)) return false;
+    }
+    return true;
+}
+
+// checks function and every function nested in its constants
+bool verifyFunction(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+
+    Verifier verifier;
+    verifier.function = function;
+    verifier.chunk = chunk;
+    verifier.starts = (bool*)calloc(chunk->count + 1, sizeof(bool));
+    verifier.depths = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    verifier.worklist = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    verifier.worklistCount = 0;
+
+    // verifier scratch isn't managed by the garbage collector
+    if (verifier.starts == NULL || verifier.depths == NULL || verifier.worklist == NULL) {
+        free(verifier.starts);
+        free(verifier.depths);
+        free(verifier.worklist);
+        outOfMemory((sizeof(bool) + sizeof(int) * 2) * (chunk->count + 1));
+    }
+    for (int i = 0; i <= chunk->count; i++) verifier.depths[i] = -1;
+
+    bool valid = verifyChunk(&verifier);
+
+    free(verifier.starts);
+    free(verifier.depths);
+    free(verifier.worklist);
+
+    for (int i = 0; valid && i < chunk->constants.count; i++) {
+        if (isObjType(chunk->constants.values[i], OBJ_FUNCTION)) {
+            valid = verifyFunction(AS_FUNCTION(chunk->constants.values[i]));
+        }
+    }
+    return valid;
+}
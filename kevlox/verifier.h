@@ -0,0 +1,8 @@
+#ifndef clox_verifier_h
+#define clox_verifier_h
+
+#include "object.h"
+
+bool verifyFunction(ObjFunction* function);
+
+#endif
@@ -1,29 +1,28 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "common.h"
 #include "debug.h"
+#include "dedup.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
+#include "verifier.h"
 #include "vm.h"
 
 VM vm; // TODO: don't make this global
 
-// returns the elapsed time since the program started running in seconds
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
-
 static void resetStack() {
     vm.stackTop = vm.stack; //  point to the beginning of the array
     vm.frameCount = 0;
     vm.openUpvalues = NULL;
+    vm.nativeDepth = 0;
 }
 
 // tell the user which line of their code was being executed when the error occurred
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
     // uses variadic functions (takes a varying number of arguments)
     va_list args; // lets us pass an abitrary number of arguments to runtimeError()
     va_start(args, format);
@@ -37,9 +36,9 @@ static void runtimeError(const char* format, ...) {
         ObjFunction* function = frame->closure->function;
         
         // calculate the current instruction pointer's position in the function's bytecode
-        // `function->chunk.code` is the start of the bytecode
+        // `frame->code` is the start of the bytecode
         // the `- 1` is because the IP is already sitting on the next instruction to be executed but we want the stack trace to point to the previous failed instruction.
-        size_t instruction = frame->ip - function->chunk.code - 1; 
+        size_t instruction = frame->ip - frame->code - 1;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
 
         if (function->name == NULL) {
@@ -50,16 +49,33 @@ static void runtimeError(const char* format, ...) {
         }
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
-    int line = frame->closure->function->chunk.lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    if (vm.frameCount > 0) {
+        CallFrame* frame = &vm.frames[vm.frameCount - 1];
+        size_t instruction = frame->ip - frame->code - 1;
+        int line = frame->closure->function->chunk.lines[instruction];
+        fprintf(stderr, "[line %d] in script\n", line);
+    }
+
+    // unwind everything, including any native that called back into Lox
+    resetStack();
+}
+
+// abandons everything that's running, natives included, and makes interpret() return a runtime
+// error. for failures that can happen anywhere and have no way to report back, like running out of
+// memory. the error should already be reported
+void throwRuntimeError() {
+    if (vm.unownedChars != NULL) {
+        FREE_ARRAY(char, vm.unownedChars, vm.unownedSize);
+        vm.unownedChars = NULL;
+    }
+    if (vm.errorJump == NULL) exit(1); // nothing running to abandon, e.g. while setting up the VM
+    longjmp(*vm.errorJump, 1);
 }
 
 // define a var so we can use native C functions
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
+void defineNative(const char* name, NativeFn function, int arity) {
+    push(OBJ_VAL(internString(name, (int)strlen(name))));
+    push(OBJ_VAL(newNative(function, arity)));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
@@ -67,19 +83,32 @@ static void defineNative(const char* name, NativeFn function) {
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
+    for (int i = 0; i < OBJ_SIZE_CLASSES; i++) {
+        vm.pages[i] = NULL;
+        vm.freeSlots[i] = NULL;
+    }
+    vm.upvaluePool = NULL;
+    for (int i = 0; i < CLOSURE_POOLS; i++) vm.closurePools[i] = NULL;
+    vm.poolHits = 0;
+    vm.poolMisses = 0;
 
     // gc
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.grayOverflow = false;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024; // arbitrary
+    // heapLimit, arenaLimit and hugePages are left as main() set them, they apply from the first allocation
+    vm.errorJump = NULL;
+    vm.unownedChars = NULL;
+    vm.unownedSize = 0;
 
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.regexes);
 
-    defineNative("clock", clockNative);
+    defineNatives();
 }
 
 // peek top of stack
@@ -100,10 +129,19 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
+    // one check for the whole call, so push() never has to
+    Value* slots = vm.stackTop - argCount - 1;
+    if (slots + closure->function->maxStack > vm.stack + STACK_MAX) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = slots;
+    frame->code = closure->function->chunk.code;
+    frame->constants = closure->function->chunk.constants.values;
     return true;
 }
 
@@ -113,10 +151,21 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                ObjNative* native = AS_NATIVE(callee);
+                if (native->arity != -1 && argCount != native->arity) {
+                    runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+                    return false;
+                }
+
+                // the result replaces the callee in the slot below the arguments. an error resets
+                // nativeDepth, so it's restored rather than decremented
+                int nativeDepth = vm.nativeDepth++;
+                bool ok = native->function(argCount, vm.stackTop - argCount);
+                vm.nativeDepth = nativeDepth;
+                // strings a collection couldn't deduplicate while it ran can be now
+                if (nativeDepth == 0) dedupDeferredStrings();
+                if (!ok) return false;
+                vm.stackTop -= argCount;
                 return true;
             }
             default:
@@ -180,12 +229,14 @@ static void concatenate() {
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// executes until the frame at index baseFrame returns, 0 runs the whole script
+static InterpretResult run(int baseFrame) {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    Value* constants = frame->constants; // kept in a register, reloaded whenever frame changes
 
     #define READ_BYTE() (*frame->ip++) // reads byte at instruction pointer
     #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    #define READ_CONSTANT() (constants[READ_BYTE()])
     #define READ_STRING() AS_STRING(READ_CONSTANT())
 
     // + - * / args must be numbers
@@ -196,11 +247,33 @@ static InterpretResult run() {
                 runtimeError("Operands must be numbers."); \
                 return INTERPRET_RUNTIME_ERROR; \
             }\
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
+            double b = AS_NUMBER(peek(0)); \
+            double a = AS_NUMBER(peek(1)); \
+            vm.stackTop -= 2; \
             push(valueType(a op b)); \
         } while (false)
 
+    // int fast path: if both operands are ints and the checked op doesn't overflow,
+    // the result stays an int and we break out of the opcode's case, otherwise fall through to the double path
+    // (deliberately not wrapped in do/while so that `break` leaves the switch)
+    #define INT_BINARY_OP(checkedOp) \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+            int32_t result; \
+            if (!checkedOp(AS_INT(peek(1)), AS_INT(peek(0)), &result)) { \
+                vm.stackTop--; \
+                vm.stackTop[-1] = INT_VAL(result); \
+                break; \
+            } \
+        }
+
+    #define INT_COMPARE_OP(op) \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+            bool result = AS_INT(peek(1)) op AS_INT(peek(0)); \
+            vm.stackTop--; \
+            vm.stackTop[-1] = BOOL_VAL(result); \
+            break; \
+        }
+
     for (;;) {
         #ifdef DEBUG_TRACE_EXECUTION
         printf("s        ");
@@ -210,7 +283,7 @@ static InterpretResult run() {
             printf("]");
         }
         printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->code));
         #endif
 
         uint8_t instruction;
@@ -262,13 +335,13 @@ static InterpretResult run() {
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
                 // the index into the current function’s upvalue array
-                push(*frame->closure->upvalues[slot]->location);
+                push(*CLOSURE_UPVALUE(frame->closure, slot)->location);
                 break;
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
                 // take the value on top of the stack and store it into the slot pointed to by the chosen upvalue
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *CLOSURE_UPVALUE(frame->closure, slot)->location = peek(0);
                 break;
             }
             case OP_EQUAL: {
@@ -277,9 +350,18 @@ static InterpretResult run() {
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER: {
+                INT_COMPARE_OP(>);
+                BINARY_OP(BOOL_VAL, >);
+                break;
+            }
+            case OP_LESS: {
+                INT_COMPARE_OP(<);
+                BINARY_OP(BOOL_VAL, <);
+                break;
+            }
             case OP_ADD: {
+                INT_BINARY_OP(__builtin_add_overflow);
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -292,8 +374,19 @@ static InterpretResult run() {
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
+            case OP_SUBTRACT: {
+                INT_BINARY_OP(__builtin_sub_overflow);
+                BINARY_OP(NUMBER_VAL, -);
+                break;
+            }
+            case OP_MULTIPLY: {
+                // a zero product with a negative operand is -0 as a double, which an int can't hold
+                if (IS_INT(peek(0)) && IS_INT(peek(1)) && AS_INT(peek(0)) != 0 && AS_INT(peek(1)) != 0) {
+                    INT_BINARY_OP(__builtin_mul_overflow);
+                }
+                BINARY_OP(NUMBER_VAL, *);
+                break;
+            }
             case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
             case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
             case OP_NEGATE: {
@@ -301,7 +394,13 @@ static InterpretResult run() {
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                Value value = pop();
+                // -0 and -INT32_MIN only exist as doubles
+                if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN) {
+                    push(INT_VAL(-AS_INT(value)));
+                } else {
+                    push(NUMBER_VAL(-AS_NUMBER(value)));
+                }
                 break;
             }
             case OP_PRINT: {
@@ -324,12 +423,39 @@ static InterpretResult run() {
                 frame->ip -= offset;
                 break;
             }
+            case OP_LOOP_LESS_LOCAL:
+            case OP_LOOP_LESS_CONSTANT: {
+                // fused `i = i + 1; if (i < limit) loop` for canonical counting for loops
+                Value* counter = &frame->slots[READ_BYTE()];
+                Value limit = instruction == OP_LOOP_LESS_LOCAL ? frame->slots[READ_BYTE()] : READ_CONSTANT();
+                uint16_t offset = READ_SHORT();
+
+                if (IS_INT(*counter) && IS_INT(limit) && AS_INT(*counter) < INT32_MAX) {
+                    *counter = INT_VAL(AS_INT(*counter) + 1);
+                    if (AS_INT(*counter) < AS_INT(limit)) frame->ip -= offset;
+                    break;
+                }
+
+                // same errors as the OP_ADD and OP_LESS this replaces
+                if (!IS_NUMBER(*counter)) {
+                    runtimeError("Operands must be two numbers or two strings");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *counter = NUMBER_VAL(AS_NUMBER(*counter) + 1);
+                if (!IS_NUMBER(limit)) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (AS_NUMBER(*counter) < AS_NUMBER(limit)) frame->ip -= offset;
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                constants = frame->constants;
                 break;
             }
             case OP_CLOSURE: {
@@ -340,7 +466,7 @@ static InterpretResult run() {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = OBJ_REF(captureUpvalue(frame->slots + index));
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
@@ -364,7 +490,12 @@ static InterpretResult run() {
 
                 vm.stackTop = frame->slots;
                 push(result);
+
+                // a native called into Lox and this is the frame it called, hand the result back to it
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
+
                 frame = &vm.frames[vm.frameCount - 1];
+                constants = frame->constants;
                 break;
             }
         }
@@ -375,28 +506,57 @@ static InterpretResult run() {
     #undef READ_CONSTANT
     #undef READ_STRING
     #undef BINARY_OP
+    #undef INT_BINARY_OP
+    #undef INT_COMPARE_OP
 }
 
 InterpretResult interpret(const char* source) {
+    jmp_buf errorJump;
+    if (setjmp(errorJump) != 0) {
+        // thrown out of compiling or running, the VM is left ready for the next interpret()
+        vm.errorJump = NULL;
+        resetCompiler();
+        resetStack();
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &errorJump;
+
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
     ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    if (function != NULL && verifyFunction(function)) {
+        push(OBJ_VAL(function)); // store function on the stack
+        ObjClosure* closure = newClosure(function);
+        pop();
+        push(OBJ_VAL(closure));
+        call(closure, 0);
+
+        result = run(0);
+    }
 
-    push(OBJ_VAL(function)); // store function on the stack
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
-    
-    // call(function, 0); // set up the first frame for executing the top-level code
+    vm.errorJump = NULL;
+    return result;
+}
+
+// lets a native call back into Lox: the callee and its arguments must be on top of the stack,
+// which also keeps them safe from the GC. runs the call to completion and leaves the result
+// in the callee's slot. returns false if the call raised a runtime error
+bool callFromNative(int argCount) {
+    int baseFrame = vm.frameCount;
+    if (!callValue(peek(argCount), argCount)) return false;
 
-    return run();
+    // natives finish inside callValue(), closures still need to run
+    if (vm.frameCount == baseFrame) return true;
+    return run(baseFrame) == INTERPRET_OK;
 }
 
 void freeVM() {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.regexes);
+    freeCompilerScratch();
     // free every object
     freeObjects();
+    freeDedupTable();
 }
 
 // push onto top of stack
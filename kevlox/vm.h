@@ -1,6 +1,9 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "chunk.h"
@@ -9,12 +12,17 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define STACK_SLACK 8 // room past STACK_MAX for values the runtime pushes to keep them visible to the GC
 
 // represents a single ongoing function call
 typedef struct {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots; // points to the VM’s value stack at the first slot that this function can use
+    // the function's chunk, set by call() so the run loop doesn't go through closure->function each time.
+    // a chunk never changes once it's compiled
+    uint8_t* code;
+    Value* constants;
 } CallFrame;
 
 typedef struct {
@@ -22,21 +30,37 @@ typedef struct {
     CallFrame frames[FRAMES_MAX]; 
     int frameCount;
 
-    Value stack[STACK_MAX]; // bytecode stack
+    Value stack[STACK_MAX + STACK_SLACK]; // bytecode stack, call() guarantees each frame fits below STACK_MAX
     Value* stackTop; // points to where the next value to be pushed will go
     Table globals; // global variables
     Table strings; // string pool for string interning
+    Table regexes; // compiled regex for each pattern string, entries go when the pattern string does
     ObjUpvalue* openUpvalues;
-    Obj* objects; // point to head of list for garbage collection
+    int nativeDepth; // natives running, which may be holding pointers into strings' chars
+    ObjPage* pages[OBJ_SIZE_CLASSES]; // every object is in a slot on one of these
+    Obj* freeSlots[OBJ_SIZE_CLASSES]; // empty slots of each size class, rebuilt by every sweep
+    Obj* upvaluePool; // slots of the upvalues the last sweep freed, for new upvalues only
+    Obj* closurePools[CLOSURE_POOLS]; // slots of the closures the last sweep freed, by upvalue count
+    uint64_t poolHits; // upvalues and closures allocated from a pool
+    uint64_t poolMisses; // and from the free lists because their pool was empty
 
     // garbage collector
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    bool grayOverflow; // objects were marked that didn't fit on the gray stack
 
     // self adjusting heap
     size_t bytesAllocated;
     size_t nextGC;
+    // settings, filled in before initVM()
+    size_t heapLimit; // most bytes the heap may hold, 0 for no limit
+    size_t arenaLimit; // bytes to bump allocate without collecting before the GC starts, 0 to collect from the start
+    bool hugePages; // whether heap pages are backed by transparent huge pages where the kernel can
+
+    jmp_buf* errorJump; // where throwRuntimeError() goes, set while interpret() runs
+    char* unownedChars; // chars no object owns yet, freed by throwRuntimeError()
+    size_t unownedSize;
 } VM;
 
 typedef enum {
@@ -52,5 +76,9 @@ void freeVM();
 InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
+void runtimeError(const char* format, ...);
+void throwRuntimeError();
+bool callFromNative(int argCount);
+void defineNative(const char* name, NativeFn function, int arity);
 
 #endif